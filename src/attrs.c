@@ -0,0 +1,103 @@
+/*
+	Cmdfs2 : attrs.c
+
+	Attributes of files found listing a directory, kept for a short time so
+	the getattr that usually follows for each entry (ls -l, file managers)
+	needs no command matching or cache lookups. Entries expire in the order
+	they were added, so memory is bounded by how much is listed in that time.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+
+static long long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// drop entries past their time, call with lock held
+static void attrs_expire( attrs_t *a, long long now ) {
+	while ( a->oldest && a->oldest->expires <= now ) {
+		attr_t *e = a->oldest;
+		a->oldest = e->next;
+		if ( htable_get(a->entries,e->path) == e )
+			htable_remove(a->entries,e->path); // else replaced since
+		free(e->path);
+		free(e);
+	}
+	if ( !a->oldest )
+		a->newest = NULL;
+}
+
+attrs_t *attrs_create( unsigned long timeout ) {
+	attrs_t *rv = calloc(1,sizeof(attrs_t));
+	rv->entries = htable_create(str_hash,str_equal);
+	rv->timeout = timeout * 1000;
+	pthread_mutex_init(&rv->lock,NULL);
+	return rv;
+}
+
+void attrs_put( attrs_t *a, const char *path, const struct stat *st ) {
+	long long now = now_ms();
+	pthread_mutex_lock(&a->lock);
+	attrs_expire(a,now);
+	attr_t *old = htable_get(a->entries,path);
+	if ( old )
+		old->expires = 0; // replaced, freed when it reaches the front
+	attr_t *e = malloc(sizeof(attr_t));
+	e->path = strdup(path);
+	e->st = *st;
+	e->expires = now + a->timeout;
+	e->next = NULL;
+	if ( a->newest )
+		a->newest->next = e;
+	else
+		a->oldest = e;
+	a->newest = e;
+	htable_put(a->entries,e->path,e);
+	pthread_mutex_unlock(&a->lock);
+}
+
+int attrs_get( attrs_t *a, const char *path, struct stat *st ) {
+	long long now = now_ms();
+	pthread_mutex_lock(&a->lock);
+	attr_t *e = htable_get(a->entries,path);
+	int rv = e && e->expires > now;
+	if ( rv )
+		*st = e->st;
+	pthread_mutex_unlock(&a->lock);
+	return rv;
+}
+
+void attrs_remove( attrs_t *a, const char *path ) {
+	pthread_mutex_lock(&a->lock);
+	attr_t *e = htable_get(a->entries,path);
+	if ( e )
+		e->expires = 0; // freed when it reaches the front
+	pthread_mutex_unlock(&a->lock);
+}
+
+void attrs_destroy( attrs_t *a ) {
+	attrs_expire(a,LLONG_MAX);
+	htable_destroy(a->entries);
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+}
@@ -3,6 +3,10 @@
 
 	Threaded (cache) directory cleaner. Will unobtrusively remove stale files
 	from a given directory using cache parameters supplied on construction.
+	Cache files are tracked in memory, in order of use and of creation, as
+	they are reported by cmdfs, so making room only costs as much as the
+	files removed. The directory is only scanned at startup and occasionally
+	to correct any drift.
 
 	Copyright (C) 2010  Mike Swain
 
@@ -27,131 +31,353 @@
 #include <time.h>
 #include <fcntl.h>
 
-#define SLEEP_MIN 2	  // Minumum sleep period between scans (won't attempt less)
-#define SLEEP_MAX 64  // Maximum approx 1 minutes (will speed up exponentially if it finds work)
+#define SLEEP_MAX 64  // Maximum approx 1 minutes between checks for expired files
+#define RESCAN_INTERVAL 3600 // secs between full scans to correct drift
+#define CACHE_SHARD_LEVELS 2 // subdirectories above each cache file (see hash_path)
+#define ORPHAN_AGE 3600 // secs after which a temporary file is taken as left by a crash
+#define EVICT_SUFFIX ".evict" // cache file claimed for removal by the cleaner
+
+extern index_t *cache_index;
 
 typedef struct {
 	struct stat st;
 	char *name;
 } entry_t;
 
-int timespeccmp( const struct timespec *a, const struct timespec *b) {
-	return a->tv_sec == b->tv_sec ?
-		( a->tv_nsec == b->tv_nsec ? 0 : a->tv_nsec < b->tv_nsec ? -1 : 1 ) :
-		a->tv_sec < b->tv_sec ? -1 : 1 ;
+typedef struct {
+	cleaner_t *c;
+	long dirsize;
+	int entries_size;
+	int entries_count;
+	entry_t *entries;
+} scan_t;
+
+// bytes a cache file accounts for, dedup blobs are shared between the paths linked to them
+static off_t entry_share( const struct stat *st ) {
+	return st->st_nlink > 1 ? st->st_size / (st->st_nlink - 1) : st->st_size;
 }
-int entry_atim_compare( const void *_a, const void *_b) {
+
+static int entry_mtim_compare( const void *_a, const void *_b) {
 	const entry_t *a = (const entry_t *)_a;
 	const entry_t *b = (const entry_t *)_b;
-	return -timespeccmp(&a->st.st_atim,&b->st.st_atim);
+	return b->st.st_mtim.tv_sec < a->st.st_mtim.tv_sec ? -1 : b->st.st_mtim.tv_sec > a->st.st_mtim.tv_sec; // newest first
 }
 
+static int lru_created_compare( const void *_a, const void *_b) {
+	const lru_entry_t *a = *(const lru_entry_t **)_a;
+	const lru_entry_t *b = *(const lru_entry_t **)_b;
+	return a->created < b->created ? -1 : a->created > b->created;
+}
 
+// Entry list maintenance, call with lock held
+static void lru_unlink( cleaner_t *c, lru_entry_t *e ) {
+	*(e->prev ? &e->prev->next : &c->mru) = e->next;
+	*(e->next ? &e->next->prev : &c->lru) = e->prev;
+	*(e->older ? &e->older->newer : &c->oldest) = e->newer;
+	*(e->newer ? &e->newer->older : &c->newest) = e->older;
+	e->prev = e->next = e->older = e->newer = NULL;
+	c->total -= e->size;
+	c->count--;
+}
 
-void *cleaner_run( void *_cleaner ) {
-	cleaner_t *c = (cleaner_t *)_cleaner;
-	struct timespec lastmod = { 0,0 };
-	while (!c->stop) {
-		long now = time(NULL);
-		struct stat st;
-		if (  !stat(c->dir, &st) && (c->age_lim > 0 || timespeccmp(&st.st_ctim,&lastmod))) { // or a file has changed
-			// Something in dir has changed, I may have work to do
-			lastmod = st.st_ctim;
-			DIR *dirp = opendir(c->dir);
-			if ( dirp ) {
-				long dirsize = 0;
-				int entries_size = 4096;
-				int entries_count = 0;
-				entry_t *entries = malloc(entries_size * sizeof(entry_t));
-				struct dirent *dp = alloc_dirent(c->dir);
-				struct dirent *dptr;
-				while ( !readdir_r(dirp,dp,&dptr) && dptr != NULL ) {
-					if (strcmp(dp->d_name,"..") && strcmp(dp->d_name,".")) {
-						if ( entries_count >= entries_size ) {
-							entries_size *= 2;
-							entries = realloc(entries,entries_size);
-						}
-						entry_t *entry = entries + entries_count;
-						char *fname;
-						if (asprintf(&fname,"%s/%s",c->dir,dp->d_name)) {
-							if ( !stat(fname,&entry->st) ) {
-								if (S_ISREG(entry->st.st_mode) && !access(fname,O_RDWR)) {
-									if ( c->age_lim <= 0 || (now - entry->st.st_mtim.tv_sec) < c->age_lim ) {
-										// Add to list of entries to be considered for culling
-										entry->name = strdup(dp->d_name);
-										entries_count++;
-										dirsize += entry->st.st_size / 1024; // total size in Kb
-									}
-									else {
-										// Definately too old, cull it now
-										if ( !unlink(fname))
-											log_debug("Expired file %s removed",fname);
-										else
-											log_error("Failed to cull file from cache directory %s (%s)",fname,strerror(errno));
-									}
-								}
-							}
-							else {
-								log_debug("Cleaner unable to stat %s - ignored (%s)",fname,strerror(errno));
-							}
-							free(fname);
-						}
-					}
-				}
-				closedir(dirp);
-				if ( 	(c->size_lim > 0 && dirsize > c->size_lim) ||
-						(c->entry_lim > 0 && entries_count > c->entry_lim) ) {
-					// Directory is over size limit or entry limit, sort by access time ready to cull
-					qsort(entries,entries_count,sizeof(entry_t),entry_atim_compare);
-					long totalsize = 0;
-					int oversize = 0;
-					int overcount = 0;
-					for ( int i = 0; i < entries_count; i++ ) {
-						entry_t *entry = entries + i;
-						if ( !oversize && !overcount) {
-							totalsize += entry->st.st_size;
-							oversize = c->size_lim > 0 && (totalsize/(1024*1024)) > c->size_lim;
-							overcount = c->entry_lim > 0 && i > c->entry_lim;
-						}
-						else {
-							char *fname;
-							if (asprintf(&fname,"%s/%s",c->dir,entry->name)) {
-								if ( !unlink(fname))
-										log_debug("Culled %s (%s)",fname,oversize ? "exceeded directory size limit" : "exceeded directory entry limit");
-									else
-										log_error("Failed to cull file from cache directory %s (%s)",fname,strerror(errno));
-									free(fname);
-								}
-						}
-					}
-
-					// Items were culled, reduce sleep period
-					if ( c->sleep > 5 )
-						c->sleep /= 2;
+// add e as most recently used (or least if cold) and newest created
+static void lru_link( cleaner_t *c, lru_entry_t *e, int cold ) {
+	if ( cold ) {
+		e->prev = c->lru;
+		*(c->lru ? &c->lru->next : &c->mru) = e;
+		c->lru = e;
+	}
+	else {
+		e->next = c->mru;
+		*(c->mru ? &c->mru->prev : &c->lru) = e;
+		c->mru = e;
+	}
+	e->older = c->newest;
+	*(c->newest ? &c->newest->newer : &c->oldest) = e;
+	c->newest = e;
+	c->total += e->size;
+	c->count++;
+}
 
-				}
-				else {
-					// No items were culled, increase sleep period
-					if ( c->sleep < SLEEP_MAX )
-						c->sleep *= 2;
+static void lru_entry_destroy( cleaner_t *c, lru_entry_t *e ) {
+	htable_remove(c->entries,e->name);
+	free(e->name);
+	free(e);
+}
 
-				}
-				for ( int i = 0; i < entries_count; i++ ) {
-					free(entries[i].name);
-				}
+static int cleaner_over( cleaner_t *c ) {
+	return (c->size_lim > 0 && c->total > (off_t)c->size_lim * 1024 * 1024) ||
+		(c->entry_lim > 0 && c->count > c->entry_lim);
+}
+
+static void cleaner_cull( cleaner_t *c, const char *name, const char *why ) {
+	char *fname;
+	if (asprintf(&fname,"%s/%s",c->dir,name) >= 0) {
+		dedup_release_cached(fname);
+		if ( !unlink(fname)) {
+			log_debug("%s %s removed",why,fname);
+			if ( cache_index )
+				index_remove_cached(cache_index,name);
+		}
+		else if ( errno != ENOENT )
+			log_error("Failed to cull file from cache directory %s (%s)",fname,strerror(errno));
+		free(fname);
+	}
+}
 
-				free(entries);
+// whether name ends with suffix
+static int has_suffix( const char *name, const char *suffix ) {
+	size_t len = strlen(name), slen = strlen(suffix);
+	return len > slen && !strcmp(name+len-slen,suffix);
+}
+
+/*
+ * Gather the cache files under rel (relative to the cache directory), which
+ * is depth levels of subdirectory above them
+ */
+static void cleaner_scan( scan_t *scan, const char *rel, int depth ) {
+	cleaner_t *c = scan->c;
+	char dir[strlen(c->dir)+strlen(rel)+2];
+	sprintf(dir,*rel ? "%s/%s" : "%s%s",c->dir,rel);
+	DIR *dirp = opendir(dir);
+	if ( !dirp ) {
+		log_warning("Cleaner unable to open cache directory %s (%s)",dir,strerror(errno));
+		return;
+	}
+	struct dirent *dp;
+	while ( (dp = readdir(dirp)) != NULL ) {
+		if (!strcmp(dp->d_name,"..") || !strcmp(dp->d_name,".") ||
+			(dp->d_name[0] == '$' && dp->d_name[1] != '$')) // reserved for cmdfs's own files (see INDEX_FILE)
+			continue;
+		char *name;
+		if (asprintf(&name,*rel ? "%s/%s" : "%s%s",rel,dp->d_name) < 0)
+			continue;
+		char fname[strlen(c->dir)+strlen(name)+2];
+		sprintf(fname,"%s/%s",c->dir,name);
+		entry_t *entry;
+		if ( scan->entries_count >= scan->entries_size ) {
+			scan->entries_size *= 2;
+			scan->entries = realloc(scan->entries,scan->entries_size * sizeof(entry_t));
+		}
+		entry = scan->entries + scan->entries_count;
+		if ( stat(fname,&entry->st) ) {
+			log_debug("Cleaner unable to stat %s - ignored (%s)",fname,strerror(errno));
+		}
+		else if ( S_ISDIR(entry->st.st_mode) && depth > 0 ) {
+			cleaner_scan(scan,name,depth-1);
+		}
+		else if (S_ISREG(entry->st.st_mode) && !access(fname,O_RDWR)) {
+			if ( depth > 0 ) {
+				// flat name from an older layout, never looked up now
+				cleaner_cull(c,name,"Unsharded file");
+			}
+			else if ( has_suffix(name,NEW_SUFFIX) || has_suffix(name,LINK_SUFFIX) || has_suffix(name,EVICT_SUFFIX) ) {
+				// output being written or linked, not a cache file until renamed
+				if ( entry->st.st_mtime < time(NULL) - ORPHAN_AGE ) {
+					if ( !unlink(fname) )
+						log_debug("Orphaned temporary file %s removed",fname);
+				}
 			}
 			else {
-				log_warning("Cleaner unable to open cache directory %s (%s)",c->dir,strerror(errno));
+				entry->name = name;
+				name = NULL;
+				scan->entries_count++;
 			}
 		}
-		if ( sleep(c->sleep) ) {
-			// signal - exit
-			log_warning("Cleaner thread terminated by signal");
-			return (void *)-1;
+		free(name);
+	}
+	closedir(dirp);
+}
+
+/*
+ * Remove dedup blobs under rel (relative to the cache directory) that no
+ * cache file links to any more
+ */
+static void cleaner_collect_blobs( cleaner_t *c, const char *rel, int depth ) {
+	char dir[strlen(c->dir)+strlen(rel)+2];
+	sprintf(dir,"%s/%s",c->dir,rel);
+	DIR *dirp = opendir(dir);
+	if ( !dirp )
+		return; // not deduplicating
+	struct dirent *dp;
+	while ( (dp = readdir(dirp)) != NULL ) {
+		if (!strcmp(dp->d_name,"..") || !strcmp(dp->d_name,"."))
+			continue;
+		char name[strlen(rel)+strlen(dp->d_name)+2];
+		sprintf(name,"%s/%s",rel,dp->d_name);
+		char fname[strlen(c->dir)+strlen(name)+2];
+		sprintf(fname,"%s/%s",c->dir,name);
+		struct stat st;
+		if ( stat(fname,&st) )
+			continue;
+		if ( S_ISDIR(st.st_mode) && depth > 0 )
+			cleaner_collect_blobs(c,name,depth-1);
+		else if ( S_ISREG(st.st_mode) && st.st_nlink == 1 ) {
+			if ( !unlink(fname) )
+				log_debug("Unreferenced blob %s removed",fname);
+		}
+	}
+	closedir(dirp);
+}
+
+/*
+ * Scan the whole cache directory and bring the tracked entries into line
+ * with it. Files not already tracked are taken as least recently used, the
+ * oldest least of all.
+ */
+static void cleaner_rescan( cleaner_t *c ) {
+	time_t started = time(NULL);
+	scan_t scan = {
+		.c = c,
+		.entries_size = 4096
+	};
+	scan.entries = malloc(scan.entries_size * sizeof(entry_t));
+	cleaner_scan(&scan,"",CACHE_SHARD_LEVELS);
+	cleaner_collect_blobs(c,BLOB_DIR,CACHE_SHARD_LEVELS);
+	qsort(scan.entries,scan.entries_count,sizeof(entry_t),entry_mtim_compare);
+
+	pthread_mutex_lock(&c->lock);
+	htable_t *seen = htable_create(str_hash,str_equal);
+	long added = 0, dropped = 0;
+	for ( int i = 0; i < scan.entries_count; i++ ) {
+		entry_t *entry = scan.entries + i;
+		lru_entry_t *e = htable_get(c->entries,entry->name);
+		if ( e ) {
+			c->total += entry_share(&entry->st) - e->size; // size may have drifted
+			e->size = entry_share(&entry->st);
+			e->ino = entry->st.st_ino;
+		}
+		else {
+			e = calloc(1,sizeof(lru_entry_t));
+			e->name = entry->name;
+			entry->name = NULL;
+			e->size = entry_share(&entry->st);
+			e->created = entry->st.st_mtime;
+			e->ino = entry->st.st_ino;
+			htable_put(c->entries,e->name,e);
+			lru_link(c,e,1);
+			added++;
+		}
+		htable_put(seen,e->name,e);
+	}
+	// forget files gone from disk, unless they were added during the scan
+	lru_entry_t **all = malloc(sizeof(lru_entry_t *) * (c->count ? c->count : 1));
+	long count = 0;
+	for ( lru_entry_t *e = c->mru, *next; e; e = next ) {
+		next = e->next;
+		if ( !htable_get(seen,e->name) && e->created < started ) {
+			lru_unlink(c,e);
+			lru_entry_destroy(c,e);
+			dropped++;
 		}
+		else
+			all[count++] = e;
+	}
+	// entries found on disk are newest by creation, put that order right
+	qsort(all,count,sizeof(lru_entry_t *),lru_created_compare);
+	c->oldest = c->newest = NULL;
+	for ( long i = 0; i < count; i++ ) {
+		all[i]->older = i ? all[i-1] : NULL;
+		all[i]->newer = i < count-1 ? all[i+1] : NULL;
+	}
+	if ( count ) {
+		c->oldest = all[0];
+		c->newest = all[count-1];
+	}
+	free(all);
+	htable_destroy(seen);
+	c->last_scan = started;
+	log_debug("Cleaner rescan: %ld entries, %ld Kb (%ld added, %ld dropped)",c->count,(long)(c->total/1024),added,dropped);
+	pthread_mutex_unlock(&c->lock);
+
+	for ( int i = 0; i < scan.entries_count; i++ )
+		free(scan.entries[i].name);
+	free(scan.entries);
+}
+
+/*
+ * Remove the file of evicted entry e, unless it has since been regenerated.
+ * Call with lock held. The file is claimed by renaming it aside first, so one
+ * published over it meanwhile is either left alone or put back. Returns
+ * whether the file was removed.
+ */
+static int cleaner_unlink( cleaner_t *c, lru_entry_t *e, const char *why ) {
+	char *fname, *claimed;
+	int removed = 0;
+	if (asprintf(&fname,"%s/%s",c->dir,e->name) < 0)
+		return 0;
+	if (asprintf(&claimed,"%s" EVICT_SUFFIX,fname) < 0) {
+		free(fname);
+		return 0;
 	}
+	struct stat st;
+	if ( rename(fname,claimed) ) {
+		if ( errno != ENOENT )
+			log_error("Failed to cull file from cache directory %s (%s)",fname,strerror(errno));
+	}
+	else if ( htable_get(c->entries,e->name) || stat(claimed,&st) || st.st_ino != e->ino ) {
+		// regenerated since it was tracked, so not ours to remove
+		if ( link(claimed,fname) && errno != EEXIST ) // EEXIST: a newer one is there
+			log_error("Failed to restore cache file %s (%s)",fname,strerror(errno));
+		unlink(claimed);
+	}
+	else {
+		dedup_release_cached(claimed);
+		if ( !unlink(claimed) ) {
+			log_debug("%s %s removed",why,fname);
+			removed = 1;
+		}
+		else
+			log_error("Failed to cull file from cache directory %s (%s)",fname,strerror(errno));
+	}
+	free(claimed);
+	free(fname);
+	return removed;
+}
+
+/*
+ * Take e out of the tracked entries and remove its file. Call with lock held,
+ * which is released while the index is updated.
+ */
+static void cleaner_evict( cleaner_t *c, lru_entry_t *e, const char *why ) {
+	lru_unlink(c,e);
+	htable_remove(c->entries,e->name);
+	int removed = cleaner_unlink(c,e,why);
+	pthread_mutex_unlock(&c->lock);
+	if ( removed && cache_index )
+		index_remove_cached(cache_index,e->name);
+	free(e->name);
+	free(e);
+	pthread_mutex_lock(&c->lock);
+}
+
+void *cleaner_run( void *_cleaner ) {
+	cleaner_t *c = (cleaner_t *)_cleaner;
+	pthread_mutex_lock(&c->lock);
+	while (!c->stop) {
+		time_t now = time(NULL);
+		if ( now - c->last_scan >= RESCAN_INTERVAL ) {
+			pthread_mutex_unlock(&c->lock);
+			cleaner_rescan(c);
+			pthread_mutex_lock(&c->lock);
+			now = time(NULL);
+		}
+		long wait = SLEEP_MAX;
+		if ( c->age_lim > 0 ) {
+			while ( !c->stop && c->oldest && now - c->oldest->created >= c->age_lim )
+				cleaner_evict(c,c->oldest,"Expired file");
+			if ( c->oldest && c->oldest->created + c->age_lim - now < wait )
+				wait = c->oldest->created + c->age_lim - now;
+		}
+		while ( !c->stop && c->lru && cleaner_over(c) )
+			cleaner_evict(c,c->lru,c->size_lim > 0 && c->total > (off_t)c->size_lim * 1024 * 1024 ?
+				"Over size limit, culled" : "Over entry limit, culled");
+		if ( c->stop )
+			break;
+		struct timespec until = { .tv_sec = time(NULL) + (wait > 0 ? wait : 1), .tv_nsec = 0 };
+		pthread_cond_timedwait(&c->wake,&c->lock,&until);
+	}
+	pthread_mutex_unlock(&c->lock);
 	return NULL;
 }
 
@@ -163,21 +389,87 @@ cleaner_t *cleaner_create( const char *dir, long size_lim, long entry_lim, long
 	rv->entry_lim = entry_lim;
 	rv->age_lim = age_lim;
 	rv->dir = strdup(dir);
-	rv->sleep = 1;
+	rv->entries = htable_create(str_hash,str_equal);
+	rv->last_scan = -RESCAN_INTERVAL; // scan on start
+	pthread_mutex_init(&rv->lock,NULL);
+	pthread_cond_init(&rv->wake,NULL);
 	pthread_create(&rv->thread,NULL,cleaner_run,rv);
 	return rv;
 }
 
+/*
+ * Record that cache file name (relative to the cache directory) has just been
+ * (re)generated with attributes st
+ */
+void cleaner_add( cleaner_t *c, const char *name, const struct stat *st ) {
+	pthread_mutex_lock(&c->lock);
+	lru_entry_t *e = htable_get(c->entries,name);
+	if ( e ) {
+		lru_unlink(c,e);
+	}
+	else {
+		e = calloc(1,sizeof(lru_entry_t));
+		e->name = strdup(name);
+		htable_put(c->entries,e->name,e);
+	}
+	e->size = entry_share(st);
+	e->created = st->st_mtime;
+	e->ino = st->st_ino;
+	lru_link(c,e,0);
+	if ( cleaner_over(c) )
+		pthread_cond_signal(&c->wake);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Record that cache file name has just been used
+ */
+void cleaner_touch( cleaner_t *c, const char *name ) {
+	pthread_mutex_lock(&c->lock);
+	lru_entry_t *e = htable_get(c->entries,name);
+	if ( e && e != c->mru ) {
+		// move to front of use order, creation order is unchanged
+		e->prev->next = e->next;
+		*(e->next ? &e->next->prev : &c->lru) = e->prev;
+		e->prev = NULL;
+		e->next = c->mru;
+		c->mru->prev = e;
+		c->mru = e;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Record that cache file name has been removed
+ */
+void cleaner_remove( cleaner_t *c, const char *name ) {
+	pthread_mutex_lock(&c->lock);
+	lru_entry_t *e = htable_get(c->entries,name);
+	if ( e ) {
+		lru_unlink(c,e);
+		lru_entry_destroy(c,e);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
 /*
  * Destroy cleaner c
  */
 void cleaner_destroy(cleaner_t *c) {
-	void *retval;
+	pthread_mutex_lock(&c->lock);
 	c->stop = 1;
-	if ( c->thread ) {
-		pthread_cancel(c->thread);
-		pthread_join(c->thread,&retval);
+	pthread_cond_signal(&c->wake);
+	pthread_mutex_unlock(&c->lock);
+	if ( c->thread )
+		pthread_join(c->thread,NULL);
+	for ( lru_entry_t *e = c->mru, *next; e; e = next ) {
+		next = e->next;
+		free(e->name);
+		free(e);
 	}
+	htable_destroy(c->entries);
+	pthread_cond_destroy(&c->wake);
+	pthread_mutex_destroy(&c->lock);
 	if ( c->dir)
 		free((void *)c->dir);
 	free(c);
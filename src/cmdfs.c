@@ -1,5 +1,5 @@
 /**
-* Required by fuse.h
+* Required by fuse_lowlevel.h
 */
 #define FUSE_USE_VERSION 26
 
@@ -8,11 +8,12 @@
 
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse.h>
+#include <fuse/fuse_lowlevel.h>
 #include <fuse/fuse_opt.h>
 #include <dirent.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <time.h>
 
 
 options_t options = {
@@ -20,6 +21,10 @@ options_t options = {
 	.link_thru = 0,
 	.stat_pass_thru = 0,
 	.monitor = 0,
+	.fanotify = 1,
+	.monitor_settle = 1,
+	.monitor_lazy = 0,
+	.monitor_idle = 600,
 	.mount_dir = NULL,
 	.base_dir = NULL,
 	.cache_dir = NULL,
@@ -27,54 +32,132 @@ options_t options = {
 	.cache_size = 0,
 	.cache_expiry = -1L,
 	.cache_max_wait = 600,
+	.transform_workers = 0,
+	.stream = 0,
+	.zero_copy = 1,
+	.mmap = 0,
+	.dedup = 0,
+	.serve_stale = 0,
+	.readdir_attrs = 1,
+	.listing_cache = 16,
+	.entry_timeout = -1,
+	.attr_timeout = -1,
+	.negative_timeout = 0,
+	.kernel_cache = 0,
+	.direct_io = 0,
+	.set_uid = 0,
+	.set_gid = 0,
+	.set_mode = 0,
 	.command = NULL,
+	.coprocess = NULL,
+	.coprocess_count = 0,
+	.plugin = NULL,
+	.plugin_opts = NULL,
+	.template = NULL,
 	.fnmatch = NULL,
 	.fnmatch_c = 0,
-	.path_regexps = NULL,
-	.path_regexp_cnt = 0,
-	.exclude_regexps = NULL,
-	.exclude_regexp_cnt = 0,
+	.rules = NULL,
 	.mime_regexps = NULL,
 	.mime_regexp_cnt = 0
 };
 
 monitor_t *monitor = NULL;
 cleaner_t *cleaner = NULL;
+scheduler_t *scheduler = NULL;
+index_t *cache_index = NULL;
+dircount_t *dircount = NULL;
+mime_t *mime = NULL;
+streams_t *streams = NULL;
+coprocs_t *coprocs = NULL;
+plugin_t *plugin = NULL;
+attrs_t *attrs = NULL;
+listings_t *listings = NULL;
+inodes_t *inodes = NULL;
+
+static struct fuse_chan *channel = NULL; // to the kernel, for telling it of changes
+
+#define UNKNOWN_INO 0xffffffff	// directory entries' inode numbers, as FUSE's high-level API gave them
 
 
-static int is_empty_visitor( const dir_info *visit, void *data ) {
-	int rv = 0;
-	if ( S_ISREG(visit->mode) ) {
-		if ( options.link_thru ) {
-			rv = 1; // there is a regular file and linked thru, so not empty
-		}
-		else {
-				vfile_t *f = file_create_from_src(visit->path);
-				rv = file_get_command(f) != NULL; // virtual file is to be generated so not empty
-				file_destroy(f);
-		}
-	}
-	return rv;
-}
 static int is_empty(const char *dirpath) {
-	return dir_visit(dirpath,-1,is_empty_visitor,NULL) == 0;
+	return dircount_is_empty(dircount,dirpath);
 }
 
 
-int cmdfs_open(const char *path, struct fuse_file_info *info) {
-	info->fh = (uint64_t)(long)file_create_from_dst(path);
+static int open_file(const char *path, struct fuse_file_info *info) {
+	vfile_t *f = file_create_from_dst(path);
+	if ( plugin && plugin_maps(plugin) && file_get_command(f) ) {
+		if ( (f->fdh = open(file_get_src(f),O_RDONLY)) < 0 ) {
+			int rv = -errno;
+			file_destroy(f);
+			return rv;
+		}
+		f->mapped = 1;
+	}
+	else if ( streams && file_get_command(f) && (f->stream = stream_open(streams,f)) )
+		info->direct_io = 1; // size isn't known until the command finishes
+	else if ( file_get_command(f) ) {
+		// check and generate the cache file now, rather than on every read
+		int rv = file_open_cached(f);
+		if ( rv < 0 ) {
+			file_destroy(f);
+			return rv;
+		}
+	}
+	if ( attrs && f->command && !f->mapped )
+		attrs_remove(attrs,path); // output may be new, so may its size
+	if ( cleaner && f->command && !f->mapped )
+		cleaner_touch(cleaner,file_get_cached_path(f)+strlen(options.cache_dir)+1);
+	info->fh = (uint64_t)(long)f;
 
 	return 0;
 }
 
-int cmdfs_getattr(const char *path, struct stat *st) {
-	vfile_t *f = file_create_from_dst(path);
+/*
+ * Turn st, the attributes of source file src, into those of path as
+ * presented. When listing nothing is generated to find the output size, 1 is
+ * returned instead if that would be needed. Otherwise returns 0 or -errno.
+ * provisional is set if the size may change without the source changing, so
+ * the kernel shouldn't keep it.
+ */
+static int path_attrs(const char *path, const char *src, struct stat *st, int listing, int *provisional) {
+	vfile_t *f = NULL;
 	int rv = 0;
-	const char *src = file_get_src(f);
-	if ( stat(src,st))
-		rv = -errno;
-	else if (S_ISREG(st->st_mode)) {
-		if ( file_get_command(f)) {
+	*provisional = 0;
+	if (S_ISREG(st->st_mode)) {
+		off_t size;
+		int indexed = cache_index ? index_lookup(cache_index,path,st,&size) : 0;
+		if ( indexed < 0 ) {
+			// loaded from a previous session, check it still matches
+			f = file_create_from_src(src);
+			if ( file_get_command(f) )
+				index_verify(cache_index,path);
+			else
+				indexed = 0;
+		}
+		if ( indexed ) {
+			// warm entry, no need to look at the cache
+			st->st_size = size;
+			st->st_mode &= S_IFREG | 0444; // always readonly
+		}
+		else if ( plugin && plugin_maps(plugin) && file_get_command(f ? f : (f = file_create_from_src(src))) ) {
+			// read through the plugin, the same size as the source
+			st->st_mode &= S_IFREG | 0444; // always readonly
+		}
+		else if ( listing && file_get_command(f ? f : (f = file_create_from_src(src))) &&
+				streams && !options.stat_pass_thru && !file_is_cached(f) ) {
+			rv = 1; // only known by joining its stream
+		}
+		else if ( file_get_command(f ? f : (f = file_create_from_src(src))) &&
+				streams && !options.stat_pass_thru && (f->stream = stream_open(streams,f)) ) {
+			// being generated, report the output so far rather than wait
+			st->st_size = stream_written(streams,f->stream);
+			st->st_mode &= S_IFREG | 0444; // always readonly
+			stream_release(streams,f->stream);
+			f->stream = NULL;
+			*provisional = 1;
+		}
+		else if ( file_get_command(f) ) {
 			// is covered by command
 		  const char *cacheName = file_get_cached_path(f);
 		  struct stat dststat;
@@ -84,12 +167,18 @@ int cmdfs_getattr(const char *path, struct stat *st) {
 		  if (options.stat_pass_thru && !cacheIsFile) { // either can pass stat through and uncached, or stat of cached file failed
 		    if ( stat(src, st))
 		      rv = -errno;
+		    *provisional = 1; // until generated
+		  } else if ( listing && !cacheExists ) {
+		    rv = 1; // would have to be generated
 		  } else {
 		    if ( !cacheExists && stat(file_encache(f),&dststat)) // okay, wasn't cached before so cache and stat
 		      rv = -errno;
 		    else {
+		      if ( cache_index && dststat.st_mtime >= st->st_mtime ) // remember it for next time
+		        index_update(cache_index,path,cacheName+strlen(options.cache_dir)+1,st,&dststat);
 		      st->st_size = dststat.st_size;
 		      st->st_mode &= S_IFREG | 0444; // always readonly
+		      *provisional = dststat.st_mtime < st->st_mtime; // from an older source, generated again when next opened
 		    }
 		  }
 		}
@@ -111,118 +200,494 @@ int cmdfs_getattr(const char *path, struct stat *st) {
 	return rv;
 }
 
+static int path_getattr(const char *path, struct stat *st, int *provisional) {
+	char src[strlen(options.base_dir)+strlen(path)+1];
+	strcpy(src,options.base_dir);
+	strcat(src,path);
+	int listed = attrs && attrs_get(attrs,path,st);
+	if ( !listed && stat(src,st) )
+		return -errno;
+	if ( monitor && S_ISDIR(st->st_mode) )
+		monitor_access(monitor,src);
+	*provisional = 0;
+	int rv = listed ? 0 : path_attrs(path,src,st,0,provisional);
+	// as set by the uid, gid and umask options
+	if ( options.set_uid )
+		st->st_uid = options.uid;
+	if ( options.set_gid )
+		st->st_gid = options.gid;
+	if ( options.set_mode )
+		st->st_mode = (st->st_mode & S_IFMT) | (0777 & ~options.umask);
+	return rv;
+}
+
+// Directory handle, the listing read through it
+typedef struct {
+	listing_t *listing;
+} dir_handle_t;
+
 struct readdir_collector {
-	fuse_fill_dir_t fill;
-	off_t offset;
-	struct fuse_file_info *info;
-	int pos;
-	void *buf;
+	listing_t *listing;
+	const char *path;
 };
+
+/*
+ * Add an entry to the listing, with its attributes if they can be found
+ * without generating anything. They're kept for the getattr that follows.
+ */
+static int readdir_add( struct readdir_collector *c, const dir_info *visit, int attributes, int subdir ) {
+	struct stat st;
+	int provisional;
+	char path[strlen(c->path)+strlen(visit->name)+2];
+	sprintf(path,"%s/%s",strcmp(c->path,"/") ? c->path : "",visit->name);
+	if ( !attrs || !attributes || stat(visit->path,&st) || path_attrs(path,visit->path,&st,1,&provisional) )
+		return listing_add(c->listing,visit->name,0,subdir);
+	if ( !provisional )
+		attrs_put(attrs,path,&st);
+	return listing_add(c->listing,visit->name,st.st_mode,subdir);
+}
 static int readdir_visitor( const dir_info *visit, void *data ) {
 	//log_debug(visit->path);
 	struct readdir_collector *c = (struct readdir_collector *)data;
-	if (++c->pos > c->offset ) {
-		int isParent = !strcmp(visit->name,"/") || !strcmp(visit->name,".."); // special case '..' looks in mount's parent
-    const char *cpath = visit->path;
-		char parent[strlen(options.mount_dir)+4];
-		if ( isParent ) {
-			sprintf(parent,"%s/..",options.mount_dir);
-			cpath = parent;
-		}
-		if (isParent || (S_ISDIR(visit->mode) && // its a dir
-				!(options.hide_empty_dirs && is_empty(cpath))) || // its empty and we're hiding empties
-				options.link_thru) { // or linking thru
-			if (c->fill(c->buf,visit->name,NULL,c->pos))
-				return -1; // break out
-		}
-		else if (!options.link_thru && S_ISREG(visit->mode)) {
-			// we don want to show if it doesn't match command filter
-			vfile_t *f = file_create_from_src(cpath);
-			if ( file_get_command(f) && c->fill(c->buf,visit->name,NULL,c->pos)) {
-					file_destroy(f);
-					return -1;
-			}
-			file_destroy(f);
+	int isParent = !strcmp(visit->name,"/") || !strcmp(visit->name,".."); // special case '..' looks in mount's parent
+	const char *cpath = visit->path;
+	char parent[strlen(options.mount_dir)+4];
+	if ( isParent ) {
+		sprintf(parent,"%s/..",options.mount_dir);
+		cpath = parent;
+	}
+	if (isParent || S_ISDIR(visit->mode) || // its a dir, hidden when read if it's empty and we're hiding empties
+			options.link_thru) { // or linking thru
+		int subdir = !isParent && strcmp(visit->name,".") && S_ISDIR(visit->mode);
+		if (readdir_add(c,visit,!isParent && strcmp(visit->name,"."),subdir))
+			return -1; // out of memory, break out
+	}
+	else if (!options.link_thru && S_ISREG(visit->mode)) {
+		// we don want to show if it doesn't match command filter
+		vfile_t *f = file_create_from_src(cpath);
+		if ( file_get_command(f) && readdir_add(c,visit,1,0)) {
+				file_destroy(f);
+				return -1;
 		}
+		file_destroy(f);
 	}
 	return 0;
 }
 
-int cmdfs_readdir(const char *path, void *buf, fuse_fill_dir_t fill, off_t offset, struct fuse_file_info *info) {
+/*
+ * List source directory src, as path. The listing is cached for others if
+ * it can't have missed any changes.
+ */
+static int readdir_list( const char *path, const char *src, listing_t **listing ) {
+	struct stat st;
+	unsigned long generation = listings ? listings_generation(listings) : 0;
+	time_t start = time(NULL);
+	int cacheable = listings && !stat(src,&st) && st.st_mtime < start; // changes later in the same second wouldn't show in mtime
+	listing_t *l = listing_create(src);
+	if ( cacheable )
+		l->mtime = st.st_mtim;
+	struct readdir_collector collect = {
+		.listing = l,
+		.path = path
+	};
+	int rv = dir_visit(src,0,readdir_visitor,&collect);
+	if ( rv ) {
+		rv = rv < 0 ? -errno : -ENOMEM;
+		listings_release(listings,l);
+		return rv;
+	}
+	if ( cacheable )
+		listings_put(listings,l,generation);
+	*listing = l;
+	return 0;
+}
+
+/*
+ * The path of inode ino, replying ESTALE and returning NULL if the kernel
+ * asks about one it has forgotten
+ */
+static char *ino_path(fuse_req_t req, fuse_ino_t ino) {
+	char *rv = inodes_path(inodes,ino);
+	if ( !rv )
+		fuse_reply_err(req,ESTALE);
+	return rv;
+}
+
+/*
+ * How long the kernel may keep the entry or attributes of path, a directory if
+ * dir. Long by default while the monitor watches to tell it of changes, both
+ * the directory the entry is in and a directory itself.
+ */
+static double cache_timeout(const char *path, int dir, double timeout) {
+	if ( timeout >= 0 )
+		return timeout; // set by option
+	int root = !strcmp(path,"/");
+	char src[strlen(options.base_dir)+strlen(path)+1];
+	sprintf(src,"%s%s",options.base_dir,root ? "" : path);
+	// with hide-empty-dirs, a directory shows or not by what's below it
+	int watched = !dir || monitor_watching(monitor,src,options.hide_empty_dirs);
+	if ( watched && !root ) {
+		*strrchr(src,'/') = '\0';
+		watched = monitor_watching(monitor,src,0);
+	}
+	return watched ? 3600 : 1;
+}
+
+static void cmdfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	char *dir = ino_path(req,parent);
+	if ( !dir )
+		return;
+	char path[strlen(dir)+strlen(name)+2];
+	sprintf(path,"%s/%s",strcmp(dir,"/") ? dir : "",name);
+	free(dir);
+	struct fuse_entry_param e;
+	int provisional;
+	memset(&e,0,sizeof(e));
+	int rv = path_getattr(path,&e.attr,&provisional);
+	if ( rv == -ENOENT && options.negative_timeout > 0 ) {
+		memset(&e,0,sizeof(e)); // ino 0, the kernel remembers it isn't there
+		e.entry_timeout = options.negative_timeout;
+		fuse_reply_entry(req,&e);
+		return;
+	}
+	if ( rv ) {
+		fuse_reply_err(req,-rv);
+		return;
+	}
+	e.ino = inodes_lookup(inodes,path,e.attr.st_ino);
+	e.entry_timeout = cache_timeout(path,S_ISDIR(e.attr.st_mode),options.entry_timeout);
+	e.attr_timeout = provisional ? 0 : cache_timeout(path,S_ISDIR(e.attr.st_mode),options.attr_timeout);
+	if ( fuse_reply_entry(req,&e) )
+		inodes_forget(inodes,e.ino,1); // interrupted, the kernel didn't get it
+}
+
+static void cmdfs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	inodes_forget(inodes,ino,nlookup);
+	fuse_reply_none(req);
+}
+
+static void cmdfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info) {
+	char *path = ino_path(req,ino);
+	if ( !path )
+		return;
+	struct stat st;
+	int provisional;
+	int rv = path_getattr(path,&st,&provisional);
+	double timeout = rv || provisional ? 0 : cache_timeout(path,S_ISDIR(st.st_mode),options.attr_timeout);
+	free(path);
+	if ( rv )
+		fuse_reply_err(req,-rv);
+	else
+		fuse_reply_attr(req,&st,timeout);
+}
+
+static void cmdfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info) {
+	char *path = ino_path(req,ino);
+	if ( !path )
+		return;
 	vfile_t *d = file_create_from_dst(path);
 	int rv = 0;
-	const char *src = file_get_src(d);
-	if (options.hide_empty_dirs && is_empty(src)) {
+	if (options.hide_empty_dirs && is_empty(file_get_src(d))) {
 		rv = -ENOENT; // dir hidden
 	}
-	else  {
-		struct readdir_collector collect = {
-			.fill = fill,
-			.offset = offset,
-			.info = info,
-			.buf = buf
-		};
-		if ( dir_visit(src,0,readdir_visitor,&collect) < 0 )
-			rv = -errno;
+	else if ( !(info->fh = (uint64_t)(long)calloc(1,sizeof(dir_handle_t))) ) {
+		rv = -ENOMEM;
 	}
 	file_destroy(d);
-	return rv;
+	free(path);
+	if ( rv )
+		fuse_reply_err(req,-rv);
+	else if ( fuse_reply_open(req,info) )
+		free((void *)(long)info->fh); // interrupted, won't be released
+}
+
+/*
+ * The directory is listed, or its cached listing taken, when read from the
+ * start. Later offsets are served from that listing, as many entries as fit
+ * in size.
+ */
+static void cmdfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *info) {
+	dir_handle_t *h = (dir_handle_t *)(long)info->fh;
+	if ( !h ) {
+		fuse_reply_err(req,EBADF);
+		return;
+	}
+	if ( !offset || !h->listing ) {
+		if ( h->listing ) {
+			listings_release(listings,h->listing); // rewound
+			h->listing = NULL;
+		}
+		char *path = ino_path(req,ino);
+		if ( !path )
+			return;
+		vfile_t *d = file_create_from_dst(path);
+		const char *src = file_get_src(d);
+		int rv = listings && (h->listing = listings_get(listings,src)) ? 0 : readdir_list(path,src,&h->listing);
+		file_destroy(d);
+		free(path);
+		if ( rv ) {
+			fuse_reply_err(req,-rv);
+			return;
+		}
+	}
+	char *buf = malloc(size);
+	if ( !buf ) {
+		fuse_reply_err(req,ENOMEM);
+		return;
+	}
+	size_t used = 0;
+	listing_t *l = h->listing;
+	for ( off_t i = offset; i < l->count; i++ ) {
+		listing_entry_t *e = &l->entries[i];
+		if ( e->subdir && options.hide_empty_dirs ) {
+			char sub[strlen(l->path)+strlen(e->name)+2];
+			sprintf(sub,"%s/%s",l->path,e->name);
+			if ( is_empty(sub) )
+				continue;
+		}
+		struct stat st = { .st_ino = UNKNOWN_INO, .st_mode = e->mode }; // only the type is used
+		size_t len = fuse_add_direntry(req,buf+used,size-used,e->name,&st,i+1);
+		if ( len > size-used )
+			break; // full, the rest are asked for from i
+		used += len;
+	}
+	fuse_reply_buf(req,buf,used);
+	free(buf);
+}
 
+static void cmdfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info) {
+	dir_handle_t *h = (dir_handle_t *)(long)info->fh;
+	if ( h ) {
+		if ( h->listing )
+			listings_release(listings,h->listing);
+		free(h);
+		info->fh = 0;
+	}
+	fuse_reply_err(req,0);
 }
 
-int cmdfs_release(const char *path, struct fuse_file_info *info) {
+static void release_file(struct fuse_file_info *info) {
 	vfile_t *f = (vfile_t *)(long)info->fh;
 	if ( f ) {
+		if ( f->stream )
+			stream_release(streams,f->stream);
 		file_destroy(f);
 		info->fh = 0;
 	}
-	return 0;
+}
 
+static void cmdfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info) {
+	char *path = ino_path(req,ino);
+	if ( !path )
+		return;
+	info->keep_cache = options.kernel_cache;
+	info->direct_io = options.direct_io; // and always for streams, set by open_file()
+	int rv = open_file(path,info);
+	free(path);
+	if ( rv )
+		fuse_reply_err(req,-rv);
+	else if ( fuse_reply_open(req,info) )
+		release_file(info); // interrupted, won't be released
 }
 
-int cmdfs_readlink(const char *path, char *buf, size_t size) {
+static void cmdfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info) {
+	release_file(info);
+	fuse_reply_err(req,0);
+}
+
+static void cmdfs_readlink(fuse_req_t req, fuse_ino_t ino) {
+	char *path = ino_path(req,ino);
+	if ( !path )
+		return;
 	vfile_t *l = file_create_from_dst(path);
-	strcpy(buf,file_get_src(l));
+	fuse_reply_readlink(req,file_get_src(l));
 	file_destroy(l);
-	return 0;
+	free(path);
 }
-int cmdfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *info) {
+
+// copy file contents to buf
+static int read_file(vfile_t *f, char *buf, size_t size, off_t offset) {
+	if ( f->stream )
+		return stream_read(streams,f->stream,buf,size,offset);
+	ssize_t n = pread(f->fdh,buf,size,offset);
+	if ( n < 0 )
+		return -errno;
+	if ( f->mapped )
+		plugin_map(plugin,buf,n,offset);
+	return n;
+}
+
+/*
+ * Mapped cache files are replied to from the mapping. With zero-copy FUSE is
+ * handed the cache file descriptor rather than a copy of its contents, so it
+ * can splice the data straight to the kernel. Otherwise, and for output
+ * transformed in memory by a plugin, it's read through a buffer.
+ */
+static void cmdfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *info) {
 	vfile_t *f = (vfile_t *)(long)info->fh;
-	if ( f ) {
-		return pread(file_get_handle(f), buf, size, offset);
+	if ( !f ) {
+		fuse_reply_err(req,EIO);
+		return;
 	}
+	if ( f->mem ) {
+		if ( offset >= f->mem_size )
+			size = 0;
+		else if ( size > f->mem_size - offset )
+			size = f->mem_size - offset;
+		fuse_reply_buf(req,(char *)f->mem + (size ? offset : 0),size);
+		return;
+	}
+	int fd = -1;
+	if ( options.zero_copy && f->stream ) {
+		ssize_t available = stream_wait(streams,f->stream,size,offset);
+		if ( available < 0 ) {
+			fuse_reply_err(req,-available);
+			return;
+		}
+		size = available;
+		fd = f->stream->rfd;
+	}
+	else if ( options.zero_copy && !f->mapped )
+		fd = f->fdh;
+	if ( fd >= 0 ) {
+		struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+		buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		buf.buf[0].fd = fd;
+		buf.buf[0].pos = offset;
+		fuse_reply_data(req,&buf,FUSE_BUF_SPLICE_MOVE);
+		return;
+	}
+	char *buf = malloc(size);
+	int n = buf ? read_file(f,buf,size,offset) : -ENOMEM;
+	if ( n < 0 )
+		fuse_reply_err(req,-n);
+	else
+		fuse_reply_buf(req,buf,n);
+	free(buf);
+}
+
+/*
+ * Called by the monitor, never from a request as the kernel may wait for
+ * requests in progress
+ */
+static void cmdfs_invalidate(unsigned long ino, const char *name) {
+	if ( name )
+		fuse_lowlevel_notify_inval_entry(channel,ino,name,strlen(name));
 	else
-		return -EIO;
+		fuse_lowlevel_notify_inval_inode(channel,ino,0,0);
 }
 
-void *cmdfs_init(struct fuse_conn_info *conn) {
+static void cmdfs_init(void *userdata, struct fuse_conn_info *conn) {
+	if ( options.zero_copy ) {
+		// without splice FUSE falls back to copying through a buffer
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	}
+	char *index_file;
+	if ( asprintf(&index_file,"%s/%s",options.cache_dir,INDEX_FILE) >= 0 ) {
+		cache_index = index_create(index_file);
+		free(index_file);
+	}
+	if ( options.hide_empty_dirs ) {
+		dircount = dircount_create();
+	}
+	if ( options.mime_regexp_cnt ) {
+		mime = mime_create(sysconf(_SC_NPROCESSORS_ONLN));
+	}
+	if ( options.readdir_attrs ) {
+		attrs = attrs_create(options.readdir_attrs);
+	}
+	if ( options.listing_cache && (options.monitor || !options.mime_regexp_cnt) ) { // else files may change type unseen
+		listings = listings_create(options.listing_cache * 1024 * 1024);
+	}
+	// start transform workers before the monitor as it will prefetch through them
+	int workers = options.transform_workers ? options.transform_workers : sysconf(_SC_NPROCESSORS_ONLN);
+	if ( workers > 0 && (scheduler = scheduler_create(workers)) ) {
+		log_debug("%d transform workers created",scheduler->workers);
+		if ( options.stream )
+			streams = streams_create();
+	}
+	if ( options.coprocess ) {
+		coprocs = coprocs_create(options.template,options.coprocess_count ? options.coprocess_count : workers);
+		log_debug("co-processes allowed: %d",coprocs->max);
+	}
+	inodes = inodes_create(cmdfs_invalidate);
 	if ( options.monitor ) {
-		monitor = monitor_create(options.base_dir,options.mount_dir);
+		monitor = monitor_create(options.base_dir,options.mount_dir,options.monitor_settle);
 		log_debug("monitor thread created");
 	}
 	if ( options.cache_entries || options.cache_size || options.cache_expiry > 0 ) {
 		cleaner = cleaner_create(options.cache_dir,options.cache_size,options.cache_entries, options.cache_expiry);
 		log_debug("cleaner thread created");
 	}
-	return NULL;
 }
 
-void cmdfs_destroy(void *p) {
+static void cmdfs_stop_monitor() {
 	if ( monitor ) {
 		monitor_destroy(monitor);
+		monitor = NULL;
 		log_debug("monitor thread destroyed");
 	}
+}
+
+static void cmdfs_destroy(void *userdata) {
+	cmdfs_stop_monitor();
 	if ( cleaner ) {
 		cleaner_destroy(cleaner);
 		log_debug("cleaner thread destroyed");
 	}
+	if ( scheduler ) {
+		scheduler_destroy(scheduler);
+		scheduler = NULL;
+		log_debug("transform workers destroyed");
+	}
+	if ( streams ) {
+		streams_destroy(streams);
+		streams = NULL;
+	}
+	if ( coprocs ) {
+		coprocs_destroy(coprocs);
+		coprocs = NULL;
+		log_debug("co-processes stopped");
+	}
+	if ( plugin ) {
+		plugin_destroy(plugin);
+		plugin = NULL;
+	}
+	if ( mime ) {
+		mime_destroy(mime);
+		mime = NULL;
+	}
+	if ( dircount ) {
+		dircount_destroy(dircount);
+		dircount = NULL;
+	}
+	if ( attrs ) {
+		attrs_destroy(attrs);
+		attrs = NULL;
+	}
+	if ( listings ) {
+		listings_destroy(listings);
+		listings = NULL;
+	}
+	if ( inodes ) {
+		inodes_destroy(inodes);
+		inodes = NULL;
+	}
+	if ( cache_index ) {
+		index_destroy(cache_index); // saves for next session
+		cache_index = NULL;
+	}
 	log_debug("end of session");
 }
-static struct fuse_operations cmdfs_operations = {
+static struct fuse_lowlevel_ops cmdfs_operations = {
 
 	.init = cmdfs_init,
+	.lookup   = cmdfs_lookup,
+	.forget   = cmdfs_forget,
 	.getattr   = cmdfs_getattr,
+    .opendir   = cmdfs_opendir,
     .readdir   = cmdfs_readdir,
+    .releasedir   = cmdfs_releasedir,
     .open   = cmdfs_open,
     .read   = cmdfs_read,
     .release = cmdfs_release,
@@ -241,6 +706,7 @@ enum
    KEY_VERSION,
    KEY_EXTENSION,
    KEY_PATH_RE,
+   KEY_IGNORED,
 	 KEY_EXCLUDE_RE,
    KEY_MIME_RE
 };
@@ -255,12 +721,59 @@ struct fuse_opt cmdfs_opts[] = {
 	CMDFS_OPT_KEY("nohide-empty-dirs", hide_empty_dirs, 0),
 	CMDFS_OPT_KEY("monitor",   monitor, 1),
 	CMDFS_OPT_KEY("nomonitor",   monitor, 0),
+	CMDFS_OPT_KEY("fanotify",   fanotify, 1),
+	CMDFS_OPT_KEY("nofanotify",   fanotify, 0),
+	CMDFS_OPT_KEY("monitor-lazy",   monitor_lazy, 1),
+	CMDFS_OPT_KEY("nomonitor-lazy",   monitor_lazy, 0),
+	CMDFS_OPT_KEY("stream",   stream, 1),
+	CMDFS_OPT_KEY("nostream",   stream, 0),
+	CMDFS_OPT_KEY("zero-copy",   zero_copy, 1),
+	CMDFS_OPT_KEY("nozero-copy",   zero_copy, 0),
+	CMDFS_OPT_KEY("mmap",   mmap, 1),
+	CMDFS_OPT_KEY("nommap",   mmap, 0),
+	CMDFS_OPT_KEY("dedup",   dedup, 1),
+	CMDFS_OPT_KEY("nodedup",   dedup, 0),
+	CMDFS_OPT_KEY("serve-stale",   serve_stale, 1),
+	CMDFS_OPT_KEY("noserve-stale",   serve_stale, 0),
+	CMDFS_OPT_KEY("readdir-attrs=%lu",   readdir_attrs, 0),
+	CMDFS_OPT_KEY("listing-cache=%lu",   listing_cache, 0),
+	CMDFS_OPT_KEY("entry_timeout=%lf",   entry_timeout, 0),
+	CMDFS_OPT_KEY("attr_timeout=%lf",   attr_timeout, 0),
+	// as FUSE's high-level API has them, so mounts made with it still work
+	CMDFS_OPT_KEY("negative_timeout=%lf",   negative_timeout, 0),
+	CMDFS_OPT_KEY("kernel_cache",   kernel_cache, 1),
+	CMDFS_OPT_KEY("direct_io",   direct_io, 1),
+	CMDFS_OPT_KEY("uid=",   set_uid, 1),
+	CMDFS_OPT_KEY("uid=%u",   uid, 0),
+	CMDFS_OPT_KEY("gid=",   set_gid, 1),
+	CMDFS_OPT_KEY("gid=%u",   gid, 0),
+	CMDFS_OPT_KEY("umask=",   set_mode, 1),
+	CMDFS_OPT_KEY("umask=%o",   umask, 0),
+	FUSE_OPT_KEY("use_ino",KEY_IGNORED),
+	FUSE_OPT_KEY("readdir_ino",KEY_IGNORED),
+	FUSE_OPT_KEY("hard_remove",KEY_IGNORED),
+	FUSE_OPT_KEY("nopath",KEY_IGNORED),
+	FUSE_OPT_KEY("noforget",KEY_IGNORED),
+	FUSE_OPT_KEY("remember=",KEY_IGNORED),
+	FUSE_OPT_KEY("auto_cache",KEY_IGNORED),
+	FUSE_OPT_KEY("noauto_cache",KEY_IGNORED),
+	FUSE_OPT_KEY("ac_attr_timeout=",KEY_IGNORED),
+	FUSE_OPT_KEY("intr",KEY_IGNORED),
+	FUSE_OPT_KEY("intr_signal=",KEY_IGNORED),
+	FUSE_OPT_KEY("modules=",KEY_IGNORED),
 
+	CMDFS_OPT_KEY("monitor-settle=%lu",   monitor_settle, 0),
+	CMDFS_OPT_KEY("monitor-idle=%lu",   monitor_idle, 0),
 	CMDFS_OPT_KEY("cache-dir=%s",   cache_dir, 0),
 	CMDFS_OPT_KEY("cache-size=%lu",   cache_size, 0),
 	CMDFS_OPT_KEY("cache-entries=%lu",   cache_entries, 0),
 	CMDFS_OPT_KEY("cache-expiry=%lu",   cache_expiry, 0),
 	CMDFS_OPT_KEY("command=%s",   command, 0),
+	CMDFS_OPT_KEY("coprocess=%s",   coprocess, 0),
+	CMDFS_OPT_KEY("coprocess-count=%u",   coprocess_count, 0),
+	CMDFS_OPT_KEY("plugin=%s",   plugin, 0),
+	CMDFS_OPT_KEY("plugin-opts=%s",   plugin_opts, 0),
+	CMDFS_OPT_KEY("transform-workers=%u",   transform_workers, 0),
 	FUSE_OPT_KEY("extension=%s",KEY_EXTENSION),
 	FUSE_OPT_KEY("path-re=%s",KEY_PATH_RE),
 	FUSE_OPT_KEY("exclude-re=%s",KEY_EXCLUDE_RE),
@@ -296,6 +809,10 @@ static int cmdfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
                      "\n"
                      "Cmdfs options:\n"
                      "    -o command=<shell command> (dd)\n"
+                     "    -o coprocess=<command> (none)\n"
+                     "    -o coprocess-count=<count> (transform-workers)\n"
+                     "    -o plugin=<shared object> (none)\n"
+                     "    -o plugin-opts=<plugin options> (none)\n"
                      "    -o extension=ext1[;ext2[;...]]\n"
                      "    -o path-re=<regular expression>\n"
 										 "    -o exclude-re=<regular expression>\n"
@@ -304,36 +821,47 @@ static int cmdfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
                          "    -o [no]stat_pass_thru (nostat_pass_thru)\n"
             		 "    -o [no]hide-empty-dirs (nohide-empty-dirs)\n"
             		 "    -o [no]monitor (nomonitor)\n"
+            		 "    -o [no]fanotify (fanotify)\n"
+            		 "    -o monitor-settle=<time in secs> (1)\n"
+            		 "    -o [no]monitor-lazy (nomonitor-lazy)\n"
+            		 "    -o monitor-idle=<time in secs> (600)\n"
+            		 "    -o [no]stream (nostream)\n"
+            		 "    -o [no]zero-copy (zero-copy)\n"
+            		 "    -o [no]mmap (nommap)\n"
+            		 "    -o [no]dedup (nodedup)\n"
+            		 "    -o [no]serve-stale (noserve-stale)\n"
+            		 "    -o readdir-attrs=<time in secs> (1)\n"
+            		 "    -o listing-cache=<size in Mb> (16)\n"
+            		 "    -o entry_timeout=<time in secs> (1, 3600 where monitored)\n"
+            		 "    -o attr_timeout=<time in secs> (1, 3600 where monitored)\n"
+            		 "    -o negative_timeout=<time in secs> (0)\n"
+            		 "    -o kernel_cache\n"
+            		 "    -o direct_io\n"
+            		 "    -o uid=<uid>, gid=<gid>, umask=<octal mask>\n"
             		 "    -o [no]stat-pass-thru (stat-pass-thru)\n"
             		 "    -o cache-dir=<dir> (%s/<user>/<source-dir>)\n"
             		 "    -o cache-size=<size in Mb> (no limit)\n"
             		 "    -o cache-entries=<count> (no limit)\n"
             		 "    -o cache-expiry=<time in secs> (no expiry)\n"
+            		 "    -o transform-workers=<count> (number of cpus)\n"
                      , outargs->argv[0], CACHE_ROOT);
              fuse_opt_add_arg(outargs, "-ho");
-             fuse_main(outargs->argc, outargs->argv, &cmdfs_operations, NULL);
+             fuse_parse_cmdline(outargs, NULL, NULL, NULL); // FUSE's general, mount and session options
+             fuse_mount(NULL, outargs);
+             fuse_lowlevel_new(outargs, &cmdfs_operations, sizeof(cmdfs_operations), NULL);
              exit(1);
 
      case KEY_VERSION:
              fprintf(stderr, "%s\n", PACKAGE_STRING);
              fuse_opt_add_arg(outargs, "--version");
-             fuse_main(outargs->argc, outargs->argv, &cmdfs_operations, NULL);
+             fuse_parse_cmdline(outargs, NULL, NULL, NULL);
              exit(0);
      case KEY_EXTENSION:
     	if (val && strlen(val)>0) {
     		char *exts = strdup(val+1);
     		char *save_ptr = NULL, *ext;
     		for ( ext = strtok_r(exts,";",&save_ptr); ext != NULL; ext = strtok_r(NULL,";",&save_ptr)) {
-    			char *expr;
-    			int err;
-    			options.path_regexps = realloc(options.path_regexps,sizeof(regex_t)*++options.path_regexp_cnt);
-    			if ( asprintf(&expr,".*/.*\\.%s",ext) < 0 )
-    				exit(0);
-    			if ((err=regcomp(options.path_regexps+(options.path_regexp_cnt-1), expr,REG_ICASE|REG_NOSUB))) {
-    				log_error("Error compiling regex: %s",get_regerror(err,options.path_regexps+(options.path_regexp_cnt-1)));
-    				return 1;
-    			}
-    			free(expr);
+    			rules_add_extension(options.rules,ext);
     		}
     		free(exts);
     		log_debug("extension: %s\n",val+1);
@@ -341,10 +869,7 @@ static int cmdfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
     	}
      case KEY_PATH_RE:
     	if (val && strlen(val)>0) {
-			int err;
-			options.path_regexps = realloc(options.path_regexps,sizeof(regex_t)*++options.path_regexp_cnt);
-			if ((err=regcomp(options.path_regexps+(options.path_regexp_cnt-1), val+1,0))) {
-				log_error("Error compiling path regex: %s",get_regerror(err,options.path_regexps+(options.path_regexp_cnt-1)));
+			if (rules_add_path_re(options.rules,val+1)) {
 				return 1;
 			}
 			log_debug("path-re: %s",val+1);
@@ -352,10 +877,7 @@ static int cmdfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
     	}
 			case KEY_EXCLUDE_RE:
      	if (val && strlen(val)>0) {
- 			int err;
- 			options.exclude_regexps = realloc(options.exclude_regexps,sizeof(regex_t)*++options.exclude_regexp_cnt);
- 			if ((err=regcomp(options.exclude_regexps+(options.exclude_regexp_cnt-1), val+1,0))) {
- 				log_error("Error compiling exclude regex: %s",get_regerror(err,options.exclude_regexps+(options.exclude_regexp_cnt-1)));
+ 			if (rules_add_exclude_re(options.rules,val+1)) {
  				return 1;
  			}
  			log_debug("exclude-re: %s",val+1);
@@ -372,6 +894,9 @@ static int cmdfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
 			log_debug("mime-re: %s",val+1);
 			return 0;
     	}
+	 case KEY_IGNORED:
+		 log_warning("%s ignored, not supported by cmdfs",arg);
+		 return 0;
 	 case FUSE_OPT_KEY_NONOPT:
 		 // base dir can be supplied as first argument (allows fstab config)
 		 if (!options.base_dir) {
@@ -394,10 +919,37 @@ void dump_options() {
 	log_debug("cache_size: %lu",options.cache_size);
 	log_debug("cache_expiry: %ld",options.cache_expiry);
 	log_debug("monitor: %d",options.monitor);
+	log_debug("fanotify: %d",options.fanotify);
+	log_debug("monitor_settle: %lu",options.monitor_settle);
+	log_debug("monitor_lazy: %d",options.monitor_lazy);
+	log_debug("monitor_idle: %lu",options.monitor_idle);
 	log_debug("link_thru: %d",options.link_thru);
 	log_debug("hide_empty_dirs: %d ",options.hide_empty_dirs);
 	log_debug("stat_pass_thru: %d",options.stat_pass_thru);
+	log_debug("transform_workers: %u",options.transform_workers);
+	log_debug("stream: %d",options.stream);
+	log_debug("zero_copy: %d",options.zero_copy);
+	log_debug("mmap: %d",options.mmap);
+	log_debug("dedup: %d",options.dedup);
+	log_debug("serve_stale: %d",options.serve_stale);
+	log_debug("readdir_attrs: %lu",options.readdir_attrs);
+	log_debug("listing_cache: %lu",options.listing_cache);
+	log_debug("entry_timeout: %g",options.entry_timeout);
+	log_debug("attr_timeout: %g",options.attr_timeout);
+	log_debug("negative_timeout: %g",options.negative_timeout);
+	log_debug("kernel_cache: %d",options.kernel_cache);
+	log_debug("direct_io: %d",options.direct_io);
+	if ( options.set_uid )
+		log_debug("uid: %u",options.uid);
+	if ( options.set_gid )
+		log_debug("gid: %u",options.gid);
+	if ( options.set_mode )
+		log_debug("umask: %03o",options.umask);
 	log_debug("command: %s\n",options.command);
+	log_debug("coprocess: %s",options.coprocess);
+	log_debug("coprocess_count: %u",options.coprocess_count);
+	log_debug("plugin: %s",options.plugin);
+	log_debug("plugin_opts: %s",options.plugin_opts);
 	for ( int i = 0; i < options.fnmatch_c; i++)
 		log_debug("extension: %s\n",options.fnmatch[i]);
 
@@ -409,10 +961,12 @@ int main(int argc, char **argv) {
 	int ret =0;
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+	options.rules = rules_create();
 	if (fuse_opt_parse(&args, &options, cmdfs_opts, cmdfs_opt_proc) == -1) {
 		/** error parsing options */
 		goto exit;
 	}
+	rules_compile(options.rules);
 
 	// default, token substitute and canonicalize cachedir
 	if ( !options.cache_dir && asprintf((char **)&options.cache_dir,"%s/%%u/%%b",CACHE_ROOT)<0) {
@@ -429,13 +983,57 @@ int main(int argc, char **argv) {
 	}
 	free((void *)toksub);
 
-	if ( options.command == NULL ) {
+	if ( options.plugin ) {
+		if ( !(plugin = plugin_create(options.plugin,options.plugin_opts)) ) {
+			fprintf(stderr,"%s: can't load plugin %s\n",argv[0],options.plugin);
+			ret = 1;
+			goto exit;
+		}
+		if ( options.command || options.coprocess )
+			log_warning("command and coprocess ignored, using plugin %s",options.plugin);
+		free((void *)options.command);
+		// identifies the output, eg for dedup
+		if ( asprintf((char **)&options.command,"%s %s",options.plugin,options.plugin_opts ? options.plugin_opts : "") < 0 ) {
+			log_error("allocate command string");
+			goto exit;
+		}
+		free((void *)options.coprocess);
+		options.coprocess = NULL;
+	}
+	else if ( options.coprocess ) {
+		if ( options.command )
+			log_warning("command %s ignored, using co-process %s",options.command,options.coprocess);
+		free((void *)options.command);
+		options.command = strdup(options.coprocess); // identifies the output, eg for dedup
+	}
+	else if ( options.command == NULL ) {
 		options.command = strdup("dd"); // default just copy original file
 	}
+	options.template = command_create(options.command);
 
 	dump_options();
 
-	ret = fuse_main(args.argc, args.argv, &cmdfs_operations, NULL);
+	char *mountpoint;
+	int multithreaded, foreground;
+	ret = 1;
+	if ( fuse_parse_cmdline(&args,&mountpoint,&multithreaded,&foreground) != -1 ) {
+		if ( (channel = fuse_mount(mountpoint,&args)) ) {
+			struct fuse_session *se = fuse_lowlevel_new(&args,&cmdfs_operations,sizeof(cmdfs_operations),NULL);
+			if ( se ) {
+				if ( fuse_set_signal_handlers(se) != -1 ) {
+					fuse_session_add_chan(se,channel);
+					fuse_daemonize(foreground);
+					ret = (multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se)) ? 1 : 0;
+					fuse_remove_signal_handlers(se);
+					cmdfs_stop_monitor(); // it tells the kernel of changes through the channel
+					fuse_session_remove_chan(channel);
+				}
+				fuse_session_destroy(se); // calls cmdfs_destroy
+			}
+			fuse_unmount(mountpoint,channel);
+		}
+		free(mountpoint);
+	}
 exit:
 	fuse_opt_free_args(&args);
 	return ret;
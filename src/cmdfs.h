@@ -31,6 +31,9 @@
 #include <assert.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "cmdfs_plugin.h"
 
 // Global Program options
 typedef struct {
@@ -38,6 +41,10 @@ typedef struct {
    int hide_empty_dirs;
    int stat_pass_thru;
    int monitor;
+   int fanotify;
+   unsigned long monitor_settle;
+   int monitor_lazy;
+   unsigned long monitor_idle;
    const char *mount_dir;
    const char *cache_dir;
    const char *base_dir;
@@ -45,18 +52,69 @@ typedef struct {
    unsigned long cache_size;
    long cache_expiry;
    unsigned long cache_max_wait;
+   unsigned int transform_workers;
+   int stream;
+   int zero_copy;
+   int mmap;
+   int dedup;
+   int serve_stale;
+   unsigned long readdir_attrs;
+   unsigned long listing_cache;
+   double entry_timeout;
+   double attr_timeout;
+   double negative_timeout;
+   int kernel_cache;
+   int direct_io;
+   int set_uid;
+   unsigned int uid;
+   int set_gid;
+   unsigned int gid;
+   int set_mode;
+   unsigned int umask;
    const char *command;
+   const char *coprocess;
+   unsigned int coprocess_count;
+   const char *plugin;
+   const char *plugin_opts;
    const char **fnmatch;
    int fnmatch_c;
-   regex_t *path_regexps;
-   int path_regexp_cnt;
-   regex_t *exclude_regexps;
-   int exclude_regexp_cnt;
+   struct command_s *template;	// command, parsed
+   struct rules_s *rules;	// extension, path-re and exclude-re
    regex_t *mime_regexps;
    int mime_regexp_cnt;
 } options_t;
 
 
+// Hash table
+typedef struct hnode_s {
+	struct hnode_s *next;
+	unsigned long hash;
+	const void *key;		// not copied, must live as long as the entry
+	void *value;
+} hnode_t;
+
+typedef struct {
+	hnode_t **buckets;
+	unsigned long size;		// number of buckets, power of 2
+	unsigned long count;	// number of entries
+	unsigned long (*hash)( const void *key );
+	int (*equal)( const void *a, const void *b );
+} htable_t;
+
+unsigned long str_hash( const void *key );
+int str_equal( const void *a, const void *b );
+unsigned long int_hash( const void *key );	// key is an integer cast to a pointer
+int int_equal( const void *a, const void *b );
+
+htable_t *htable_create( unsigned long (*hash)(const void *), int (*equal)(const void *, const void *) );
+void *htable_get( htable_t *h, const void *key );
+void *htable_put( htable_t *h, const void *key, void *value ); // returns replaced value, if any
+void *htable_remove( htable_t *h, const void *key ); // returns removed value, if any
+int htable_visit( htable_t *h, int (*visitor)(const void *key, void *value, void *data), void *data );
+void htable_destroy( htable_t *h );
+
+
+
 // Virtual file abstraction
 typedef struct  {
 	char *src;
@@ -64,6 +122,11 @@ typedef struct  {
 	char *cached;
 	const char *command;
 	int fdh;
+	struct stream_s *stream;	// when being read as generated
+	char *blob;				// shared output for the source content, in dedup mode
+	int mapped;				// fdh is the source, read through the plugin's map
+	void *mem;				// fdh mapped into memory, with the mmap option
+	size_t mem_size;
 } vfile_t ;
 
 vfile_t *file_create_from_src(const char *src);
@@ -74,16 +137,38 @@ const char *file_get_cached_path(vfile_t *f);
 const char *file_get_command(vfile_t *f);
 const char *file_encache(vfile_t *f);
 void file_decache( vfile_t *f );
-int file_get_handle(vfile_t *f);
+int file_is_cached( vfile_t *f );
+#define CACHE_PATH_XATTR "user.cmdfs.path"	// on cache files, the path they're for
+#define NEW_SUFFIX ".new"	// new output, written beside the cache file
+int file_create_new( vfile_t *f, int *reader );
+int file_publish( vfile_t *f, int status );
+int file_flight_start( vfile_t *f );
+int file_flight_wait( vfile_t *f );
+void file_flight_finish( vfile_t *f, int status );
+int file_serve_stale( vfile_t *f );
+pid_t file_spawn( vfile_t *f, int out );
+int file_open_cached( vfile_t *f );
 void file_destroy( vfile_t *f );
 
 
 
 // Directory monitoring
-typedef struct {
-	int wd;
-	char *path;
-} wd_t;
+typedef struct watch_s {
+	int wd;						// -1 while waiting for inotify resource
+	const char *name;			// interned, full path for the root
+	struct timespec mtime;		// when last listed
+	time_t used;				// when last accessed, in lazy mode
+	struct watch_s *parent;
+	struct watch_s *children;	// linked by sibling
+	struct watch_s *sibling;
+	struct watch_s *pending;	// next waiting for inotify resource
+} watch_t;
+
+typedef struct settle_s {
+	char *path;				// source file
+	long due;				// monotonic ms when it will have settled
+	struct settle_s *prev, *next;	// in order due
+} settle_t;
 
 typedef struct {
 	const char *rootdir;
@@ -91,26 +176,68 @@ typedef struct {
 	int fd;
 	pthread_t thread;
 	int stop;
-	wd_t *wd_lut;
-	int wd_lut_count;
-	int wd_lut_size;
-	int status;
+	htable_t *watches;	// by wd
+	htable_t *names;	// interned directory names
+	watch_t *root;
+	watch_t *pending;
+	htable_t *settling;	// settle_t by path, files changed recently
+	settle_t *settle_head, *settle_tail;
+	long settle_ms;		// quiet period before a changed file is cached
+	int lazy;			// directories watched once accessed
+	long idle;			// secs unused before a lazy watch is dropped
+	long evict_due;		// monotonic ms
+	htable_t *accessed;	// directories accessed since the monitor last looked
+	htable_t *unwatched;	// source directories without a watch, UNWATCHED_*
+	int ready;			// initial watches added, or the fanotify mark
+	pthread_mutex_t lock;	// for accessed, unwatched, ready and status
+	int wake_fd;		// eventfd to wake the monitor when accessed is added to
+	int fanotify;	// whole filesystem watched by fd, no watches
+	int status;			// errno once stopped by a failure
 
 } monitor_t;
 
-monitor_t *monitor_create( const char *rootdir, const char *mountdir );
+/*
+ * Create a monitor thread for source directory rootdir, caching new and changed
+ * files once they've been left alone for settle secs
+ */
+monitor_t *monitor_create( const char *rootdir, const char *mountdir, long settle );
+
+/*
+ * Whether changes in source directory path, and with below in every
+ * directory under it, are being reported. Not if m is NULL, lazy, failed or
+ * still starting, or inotify watches couldn't be added. Others must check
+ * for changes themselves.
+ */
+int monitor_watching( monitor_t *m, const char *path, int below );
+void monitor_access( monitor_t *m, const char *path );
 void monitor_destroy(monitor_t *m);
 void *monitor_run( void *_monitor ); // note void ptr for threaded use
 
 // Cache cleaning thread
+typedef struct lru_entry_s {
+	char *name;					// cache file, relative to the cache directory
+	off_t size;					// bytes accounted to it
+	time_t created;				// when generated
+	ino_t ino;					// of the cache file, to tell it from a regenerated one
+	struct lru_entry_s *prev, *next;	// use order, most recent first
+	struct lru_entry_s *older, *newer;	// creation order
+} lru_entry_t;
+
 typedef struct {
 	const char *dir;
 	pthread_t thread;
 	int stop;
-	long size_lim; 	// limit on directory size, in Kb (0 = no limit)
+	long size_lim; 	// limit on directory size, in Mb (0 = no limit)
 	long entry_lim; // limit on size, in number of entries (0 = no limit)
 	long age_lim;   // max age (secs) of valid files
-	long sleep;		// Time next cycle will sleep for
+	htable_t *entries;			// cache file name to lru_entry_t
+	lru_entry_t *mru, *lru;
+	lru_entry_t *newest, *oldest;
+	off_t total;				// bytes in entries
+	long count;					// number of entries
+	time_t last_scan;			// last full scan of dir
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
 } cleaner_t;
 
 /*
@@ -120,15 +247,460 @@ typedef struct {
  *  it was last modified longer ago than age_lim (if>0) secs
  * One or more of size_lim,entry_lim, age_lim must be specified.
  * Directory contents which are not regular, writeable files will be untouched and excluded
- * from the size and count totals. Candidate files to be removed will be chosen by oldest access time
+ * from the size and count totals. Candidate files to be removed will be chosen by least recent use,
+ * as reported with cleaner_add() and cleaner_touch(). The directory is scanned on start and
+ * periodically after that to pick up any changes not reported.
  */
 cleaner_t *cleaner_create( const char *dir, long size_lim, long entry_lim, long age_lim);
 
+/*
+ * Report cache file name (relative to dir) generated, used or removed
+ */
+void cleaner_add( cleaner_t *c, const char *name, const struct stat *st );
+void cleaner_touch( cleaner_t *c, const char *name );
+void cleaner_remove( cleaner_t *c, const char *name );
+
 /*
  * Destroy cleaner c
  */
 void cleaner_destroy(cleaner_t *m);
 
+// Transform scheduler
+typedef struct job_s job_t;
+
+typedef struct {
+	pthread_t *threads;
+	int workers;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	// signalled when a job is queued
+	job_t *head;			// FIFO of queued jobs
+	job_t *tail;
+	int queued;
+	int running;
+	int stop;
+} scheduler_t;
+
+/*
+ * Create a scheduler with a pool of workers threads. Jobs are run in FIFO
+ * order, at most workers at a time.
+ */
+scheduler_t *scheduler_create( int workers );
+
+/*
+ * Queue fn(arg) on scheduler s and wait for it to complete, returns fn's result.
+ * Jobs already running on s's workers run fn straight away.
+ */
+int scheduler_run( scheduler_t *s, int (*fn)(void *), void *arg );
+
+/*
+ * Queue fn(arg) on scheduler s and return without waiting for it
+ */
+void scheduler_submit( scheduler_t *s, int (*fn)(void *), void *arg );
+
+/*
+ * Whether the calling thread is one of s's workers, which mustn't wait on
+ * jobs that may be queued behind it
+ */
+int scheduler_is_worker( scheduler_t *s );
+
+/*
+ * Destroy scheduler s, running any jobs already queued
+ */
+void scheduler_destroy( scheduler_t *s );
+
+
+
+// Cache metadata index
+#define INDEX_FILE "$index"		// in cache directory, hash_path() names are all in subdirectories
+typedef struct {
+	char *path;				// destination path (key)
+	char *cached;			// cache file name, relative to cache directory
+	ino_t src_ino;			// source attributes the output was generated from
+	struct timespec src_mtime;
+	off_t src_size;
+	off_t size;				// output size
+	time_t created;			// when output was generated
+	int verified;			// path known to match in this session
+} index_entry_t;
+
+typedef struct {
+	const char *file;
+	htable_t *entries;		// by path
+	htable_t *by_cached;	// by cache file name
+	pthread_mutex_t lock;
+	int dirty;				// modified since last save
+	unsigned long generation;	// bumped by every addition or removal
+	pthread_t saver;		// saves periodically while dirty
+	pthread_cond_t wake;	// signalled to stop the saver
+	int saving;				// saver running
+	int stop;
+} index_t;
+
+/*
+ * Create an index, loading any previously saved to file
+ */
+index_t *index_create( const char *file );
+int index_lookup( index_t *x, const char *path, const struct stat *src, off_t *size );
+void index_verify( index_t *x, const char *path );
+void index_update( index_t *x, const char *path, const char *cached, const struct stat *src, const struct stat *out );
+void index_remove( index_t *x, const char *path );
+void index_remove_cached( index_t *x, const char *cached );
+char **index_paths_in( index_t *x, htable_t *dirs );
+unsigned long index_generation( index_t *x );
+int index_save( index_t *x );
+
+/*
+ * Save and destroy index x
+ */
+void index_destroy( index_t *x );
+
+
+
+// Attributes found listing directories, answering the getattr calls that follow
+typedef struct attr_s {
+	char *path;				// destination path (key)
+	struct stat st;
+	long long expires;		// monotonic ms
+	struct attr_s *next;	// added after this one
+} attr_t;
+
+typedef struct {
+	htable_t *entries;		// by path
+	attr_t *oldest;			// expiry order
+	attr_t *newest;
+	long long timeout;		// ms
+	pthread_mutex_t lock;
+} attrs_t;
+
+attrs_t *attrs_create( unsigned long timeout );
+void attrs_put( attrs_t *a, const char *path, const struct stat *st );
+int attrs_get( attrs_t *a, const char *path, struct stat *st ); // 1 if found and not expired
+void attrs_remove( attrs_t *a, const char *path );
+void attrs_destroy( attrs_t *a );
+
+
+
+// Filtered directory listings, shared between handles when cached
+typedef struct {
+	char *name;
+	mode_t mode;			// 0 if attributes weren't found
+	int subdir;				// shown only if not empty, with hide-empty-dirs
+} listing_entry_t;
+
+typedef struct listing_s {
+	char *path;				// source directory (key)
+	struct timespec mtime;	// of the directory before it was listed
+	listing_entry_t *entries;
+	int count;
+	int size;
+	size_t bytes;			// memory used
+	int refs;				// handles reading it, and the cache
+	struct listing_s *newer;	// least recently used order, when cached
+	struct listing_s *older;
+} listing_t;
+
+typedef struct {
+	htable_t *listings;		// by path
+	listing_t *newest;
+	listing_t *oldest;
+	size_t bytes;
+	size_t budget;
+	unsigned long generation;	// bumped by every change
+	pthread_mutex_t lock;
+} listings_t;
+
+listing_t *listing_create( const char *path );
+int listing_add( listing_t *l, const char *name, mode_t mode, int subdir );
+listings_t *listings_create( size_t budget );
+
+/*
+ * A reference to the cached listing of source directory path if it's up to
+ * date, or NULL
+ */
+listing_t *listings_get( listings_t *ls, const char *path );
+unsigned long listings_generation( listings_t *ls );
+
+/*
+ * Cache listing l, unless there were changes since generation
+ */
+void listings_put( listings_t *ls, listing_t *l, unsigned long generation );
+void listings_release( listings_t *ls, listing_t *l ); // ls NULL if there's no cache
+void listings_changed( listings_t *ls, const char *path, int below ); // below: and directories below it
+void listings_destroy( listings_t *ls );
+
+
+
+// Inode numbers for paths known to the kernel
+#define INODE_ROOT 1
+
+typedef struct {
+	unsigned long ino;		// given to the kernel (key)
+	char *path;				// destination path looked up
+	ino_t src_ino;			// of the source when looked up
+	unsigned long lookups;	// held by the kernel, until it forgets them
+	int current;			// path still leads here, not to a replacement
+} inode_t;
+
+typedef struct {
+	htable_t *by_ino;
+	htable_t *by_path;		// current ones only
+	unsigned long next;
+	void (*invalidate)(unsigned long ino, const char *name); // tells the kernel to drop an entry (name), or the inode's attributes and contents
+	pthread_mutex_t lock;
+} inodes_t;
+
+inodes_t *inodes_create( void (*invalidate)(unsigned long ino, const char *name) );
+
+/*
+ * The inode number for path, a new one if its source src_ino differs, with
+ * a lookup added for the kernel to forget
+ */
+unsigned long inodes_lookup( inodes_t *t, const char *path, ino_t src_ino );
+char *inodes_path( inodes_t *t, unsigned long ino ); // copy of its path, NULL if not known
+void inodes_forget( inodes_t *t, unsigned long ino, unsigned long lookups );
+
+/*
+ * Have the kernel drop what it caches for path, and its entry in the parent
+ * directory. With ancestors the entries up to the root too, whose emptiness
+ * may have changed.
+ */
+void inodes_changed( inodes_t *t, const char *path, int ancestors );
+void inodes_invalidate( inodes_t *t ); // everything the kernel caches, when changes won't be reported
+void inodes_destroy( inodes_t *t );
+
+
+
+// Matching file counts for hiding empty directories
+typedef struct dnode_s {
+	char *path;				// source directory (key)
+	struct dnode_s *parent;
+	struct dnode_s *child;	// first subdirectory
+	struct dnode_s *sibling;
+	long direct;			// matching files in this directory
+	long total;				// matching files in this directory and below
+	struct timespec mtime;	// of directory when counted
+	long pending;			// directories here and below not yet counted
+	int uncounted;			// not yet scanned, direct isn't known
+	int dirty;				// reported changed, recount before use
+	struct dnode_s *next_dirty;
+} dnode_t;
+
+typedef struct {
+	htable_t *nodes;		// by path
+	dnode_t *dirty;			// list of directories to recount
+	pthread_mutex_t lock;	// not held while directories are read
+	pthread_cond_t counted;	// some directories have been scanned
+} dircount_t;
+
+dircount_t *dircount_create();
+
+/*
+ * Return whether the directory path has no matching files in it or any
+ * subdirectory. Counted once then maintained incrementally.
+ */
+int dircount_is_empty( dircount_t *d, const char *path );
+
+/*
+ * Report entries of directory path have changed
+ */
+void dircount_changed( dircount_t *d, const char *path );
+void dircount_destroy( dircount_t *d );
+
+
+
+// Mime type matching
+typedef struct {
+	struct magic_set **handles;	// free libmagic handles
+	int free_count;
+	int open_count;
+	int size;				// max handles to open
+	htable_t *decisions;	// previous results by inode
+	pthread_mutex_t lock;
+	pthread_cond_t available;	// signalled when a handle is released
+} mime_t;
+
+/*
+ * Create a mime matcher using up to handles libmagic handles concurrently
+ */
+mime_t *mime_create( int handles );
+
+/*
+ * Return whether path has a mime type matching one of the mime-re options
+ */
+int mime_match( mime_t *m, const char *path );
+void mime_destroy( mime_t *m );
+
+
+
+// Content addressed (deduplicated) cache
+#define BLOB_DIR "$blobs"		// in cache directory, outputs by content
+#define BLOB_XATTR "user.cmdfs.blob"	// on dedup cache files, the blob they link to
+#define LINK_SUFFIX ".link"	// new link to a blob, renamed over the cache file
+
+/*
+ * Link f's cache file to existing output for the same content, returns 1 if
+ * done and f need not be transformed
+ */
+int dedup_fetch( vfile_t *f );
+
+/*
+ * Keep f's new output as the blob for its content
+ */
+void dedup_store( vfile_t *f );
+
+/*
+ * Remove the blob of a cache file about to be removed, if nothing else needs it
+ */
+void dedup_release( vfile_t *f );
+void dedup_release_cached( const char *cached );
+
+
+
+// Progressive reads of files being generated
+typedef struct stream_s {
+	struct streams_s *owner;
+	vfile_t *f;
+	int fd;					// new output, written by the worker
+	int rfd;				// and read by readers until published
+	off_t written;
+	int done;
+	int status;				// command exit status, once done
+	int refs;
+	pthread_cond_t progress;	// broadcast as output is written
+} stream_t;
+
+typedef struct streams_s {
+	htable_t *active;		// cache path -> stream_t
+	pthread_mutex_t lock;
+} streams_t;
+
+streams_t *streams_create();
+
+/*
+ * Attach to the stream generating f, starting one if f isn't cached. Returns
+ * NULL if f can be read from the cache as normal.
+ */
+stream_t *stream_open( streams_t *ss, vfile_t *f );
+
+/*
+ * Wait for output past offset, returning how much of size can be read from
+ * s->rfd now, or -EIO if the command failed
+ */
+ssize_t stream_wait( streams_t *ss, stream_t *s, size_t size, off_t offset );
+
+/*
+ * As pread(), but waits for output past offset while the command is running
+ */
+int stream_read( streams_t *ss, stream_t *s, char *buf, size_t size, off_t offset );
+off_t stream_written( streams_t *ss, stream_t *s );
+void stream_release( streams_t *ss, stream_t *s );
+void streams_destroy( streams_t *ss );
+
+
+
+// Command templates
+typedef struct command_s {
+	char *text;
+	char **argv;	// words to run directly, NULL if run by the shell
+	int argc;
+} command_t;
+
+/*
+ * Parse command text, as given in the command option
+ */
+command_t *command_create( const char *text );
+
+/*
+ * Start command c for source file src, with its input from in and output to
+ * out. src may be NULL for a co-process. Returns the child's pid or -1.
+ */
+pid_t command_spawn( command_t *c, const char *src, int in, int out );
+void command_destroy( command_t *c );
+
+
+
+// Co-processes, long-lived commands transforming one file per request
+typedef struct coproc_s {
+	pid_t pid;
+	FILE *requests;			// to its stdin
+	FILE *responses;		// from its stdout
+	struct coproc_s *next;	// when idle
+} coproc_t;
+
+typedef struct {
+	command_t *command;
+	int max;				// processes allowed
+	int count;				// processes running
+	coproc_t *idle;
+	pthread_mutex_t lock;
+	pthread_cond_t available;
+} coprocs_t;
+
+coprocs_t *coprocs_create( command_t *command, int max );
+
+/*
+ * Have a co-process transform source file src, passing its output to sink.
+ * Returns 0 on success, the status the co-process reported on failure or -1
+ * if there was no usable co-process or the sink failed.
+ */
+int coprocs_run( coprocs_t *cs, const char *src, cmdfs_sink_t sink, void *data );
+void coprocs_destroy( coprocs_t *cs );
+
+
+
+// In-process transform plugins
+typedef struct {
+	void *handle;				// from dlopen()
+	const cmdfs_plugin_t *api;
+	void *state;				// from its init
+} plugin_t;
+
+plugin_t *plugin_create( const char *path, const char *opts );
+int plugin_maps( plugin_t *p );
+int plugin_transform( plugin_t *p, const char *src, cmdfs_sink_t sink, void *data );
+void plugin_map( plugin_t *p, char *buf, size_t size, off_t offset );
+void plugin_destroy( plugin_t *p );
+
+
+
+// File selection rules
+typedef struct {
+	const char *kind;		// for messages
+	char **patterns;		// as given
+	int count;
+	regex_t combined;		// all patterns that can be merged
+	int has_combined;
+	regex_t *separate;		// those that can't
+	int separate_cnt;
+} re_set_t;
+
+typedef struct rules_s {
+	htable_t *extensions;	// lower case
+	re_set_t paths;
+	re_set_t excludes;
+} rules_t;
+
+rules_t *rules_create();
+int rules_add_extension( rules_t *r, const char *ext );
+int rules_add_path_re( rules_t *r, const char *re );	// returns regcomp error, if any
+int rules_add_exclude_re( rules_t *r, const char *re );
+
+/*
+ * Build matchers once all rules have been added
+ */
+void rules_compile( rules_t *r );
+
+/*
+ * Return whether path matches an exclude-re
+ */
+int rules_excluded( rules_t *r, const char *path );
+
+/*
+ * Return whether path has one of the extensions or matches a path-re
+ */
+int rules_match( rules_t *r, const char *path );
+void rules_destroy( rules_t *r );
+
 
 
 // Error logging
@@ -139,8 +711,13 @@ void log_debug( const char *fmt, ...);
 // Utils
 char *token_substitute(const char *str, const char *token, const char *value );
 char *tokens_substitute(const char *str, const char *tokens[], const char *values[] );
+#define HASH_PATH_LEN 38	// "xx/xx/" and 32 hex digits
 const char *hash_path(const char *path);
+char *shard_name( uint64_t h1, uint64_t h2 );
+void hash_string( const char *str, uint64_t h[2] );
+int hash_content( int fd, uint64_t h[2] );
 const char *makepath( const char *path );
+void make_parents( const char *path, const char *root );
 char *alloc_path(const char *dirpath);
 struct dirent *alloc_dirent(const char *dirpath);
 int quick_stat(char *fullpath, struct dirent *dp );
@@ -0,0 +1,66 @@
+/*
+	Cmdfs2 : cmdfs_plugin.h
+
+	Plugin interface, for transforms run inside cmdfs rather than as a
+	command. A plugin is a shared object, named with -o plugin=, exporting a
+	cmdfs_plugin_t called cmdfs_plugin. Its functions are called from several
+	transform workers at once, so any state they share must be thread safe.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef CMDFS_PLUGIN_H_
+#define CMDFS_PLUGIN_H_
+#include <stddef.h>
+#include <sys/types.h>
+
+#define CMDFS_PLUGIN_ABI 1			// changed whenever cmdfs_plugin_t is
+#define CMDFS_PLUGIN_SYMBOL "cmdfs_plugin"
+
+/*
+ * Takes output as it is produced. Returns non-zero if it couldn't be kept,
+ * in which case the transform should give up.
+ */
+typedef int (*cmdfs_sink_t)( void *data, const char *buf, size_t size );
+
+typedef struct {
+	int abi;				// CMDFS_PLUGIN_ABI
+	const char *name;
+
+	/*
+	 * Set up, given the plugin-opts option (NULL if none). Returns the state
+	 * passed to the other functions, or NULL on failure. Optional.
+	 */
+	void *(*init)( const char *opts );
+
+	/*
+	 * Transform the source file open on in, passing the output to sink.
+	 * Returns 0 on success, non-zero on failure.
+	 */
+	int (*transform)( void *state, int in, cmdfs_sink_t sink, void *data );
+
+	/*
+	 * For transforms where each output byte depends only on the input byte
+	 * at the same offset: transform size bytes read from the source at
+	 * offset, in place. With this, files are read straight from their source
+	 * and never cached. Optional.
+	 */
+	void (*map)( void *state, char *buf, size_t size, off_t offset );
+
+	void (*fini)( void *state );	// optional
+} cmdfs_plugin_t;
+
+#endif /* CMDFS_PLUGIN_H_ */
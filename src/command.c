@@ -0,0 +1,131 @@
+/*
+	Cmdfs2 : command.c
+
+	Command templates. The command option is parsed once, when mounting. A
+	command using nothing only a shell would understand is split into words
+	and run directly, anything else is run by /bin/sh -c as before. Commands
+	are started with posix_spawn(), which doesn't copy the daemon's address
+	space the way fork() does.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <spawn.h>
+
+#define SHELL "/bin/sh" 		// shell exec
+#define SHELL_NAME "sh" 		// name to provide in argv[0]
+#define TOKEN "%f"				// token to substtue with filename
+#define FILE_ENV_VAR "INPUT_FILE"
+#define SHELL_CHARS "|&;<>()$`\\\"'*?[#~\n" // quoting, expansion, redirection, globbing...
+#define WORD_SEPARATORS " \t"
+
+// words that mean something else, or nothing, outside a shell
+static const char *shell_words[] = {
+	"if", "then", "else", "elif", "fi", "case", "esac", "for", "while", "until", "do", "done",
+	"in", "{", "}", "!", ".", ":", "alias", "cd", "command", "eval", "exec", "exit", "export",
+	"read", "readonly", "return", "set", "shift", "times", "trap", "ulimit", "umask", "unset",
+	"wait", NULL
+};
+
+// whether text has to be run by the shell
+static int command_needs_shell( const char *text ) {
+	if ( strpbrk(text,SHELL_CHARS) || strstr(text,"%%") ) // %% is left for the shell to see
+		return 1;
+	const char *first = text+strspn(text,WORD_SEPARATORS);
+	size_t len = strcspn(first,WORD_SEPARATORS);
+	if ( !len || memchr(first,'=',len) ) // nothing, or sets a variable
+		return 1;
+	for ( const char **word = shell_words; *word; word++ ) {
+		if ( strlen(*word) == len && !strncmp(first,*word,len) )
+			return 1;
+	}
+	return 0;
+}
+
+command_t *command_create( const char *text ) {
+	command_t *rv = calloc(1,sizeof(command_t));
+	rv->text = strdup(text);
+	if ( !command_needs_shell(text) ) {
+		char *words = strdup(text);
+		char *save = NULL;
+		rv->argv = calloc(strlen(text)/2+2,sizeof(char *)); // enough for every other char a separator
+		for ( char *word = strtok_r(words,WORD_SEPARATORS,&save); word; word = strtok_r(NULL,WORD_SEPARATORS,&save) )
+			rv->argv[rv->argc++] = strdup(word);
+		free(words);
+	}
+	log_debug("Command %s run %s",text,rv->argv ? "directly" : "by " SHELL);
+	return rv;
+}
+
+/*
+ * Start command c for source file src, with input from in and output to out.
+ * With no src, for co-processes, the command is run as written. Returns the
+ * child's pid, or -1 if it could not be started.
+ */
+pid_t command_spawn( command_t *c, const char *src, int in, int out ) {
+	char *env = NULL;
+	if ( src && asprintf(&env,"%s=%s",FILE_ENV_VAR,src) < 0 ) {
+		log_error("Creating child environment (%s)",strerror(errno));
+		return -1;
+	}
+	char *envp[] = { env, NULL };
+	char *argv[c->argv ? c->argc+1 : 4];
+	if ( c->argv ) {
+		for ( int i = 0; i < c->argc; i++ )
+			argv[i] = src && strstr(c->argv[i],TOKEN) ? token_substitute(c->argv[i],TOKEN,src) : c->argv[i];
+		argv[c->argc] = NULL;
+	}
+	else {
+		argv[0] = SHELL_NAME;
+		argv[1] = "-c";
+		argv[2] = src ? token_substitute(c->text,TOKEN,src) : c->text;
+		argv[3] = NULL;
+	}
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions,in,STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions,out,STDOUT_FILENO);
+	pid_t pid;
+	int err = c->argv ?
+		posix_spawnp(&pid,argv[0],&actions,NULL,argv,envp) : // PATH searched is cmdfs's own
+		posix_spawn(&pid,SHELL,&actions,NULL,argv,envp);
+	posix_spawn_file_actions_destroy(&actions);
+	if ( c->argv ) {
+		for ( int i = 0; i < c->argc; i++ ) {
+			if ( argv[i] != c->argv[i] )
+				free(argv[i]);
+		}
+	}
+	else if ( argv[2] != c->text )
+		free(argv[2]);
+	free(env);
+	if ( err ) {
+		log_error("Command launch failed: %s (%s)",c->text,strerror(err));
+		return -1;
+	}
+	return pid;
+}
+
+void command_destroy( command_t *c ) {
+	if ( c->argv ) {
+		for ( int i = 0; i < c->argc; i++ )
+			free(c->argv[i]);
+		free(c->argv);
+	}
+	free(c->text);
+	free(c);
+}
@@ -0,0 +1,182 @@
+/*
+	Cmdfs2 : coproc.c
+
+	Co-processes. Instead of a command per file, a pool of long-lived
+	processes is started as needed, each taking one file at a time. A request
+	is the source file's path and a newline, written to the process's stdin.
+	The reply on its stdout is a series of chunks, each a decimal byte count
+	and a newline followed by that many bytes of output, ending with a count
+	of 0 on success or a negative count, the exit status negated, on failure.
+	A process that dies or breaks the protocol is discarded and replaced on
+	next use. Processes are sent end of file and terminated when unmounting.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define CHUNK_BUFFER 65536
+#define COUNT_MAX 24 // digits, sign and newline of a chunk count
+
+static coproc_t *coproc_start( coprocs_t *cs ) {
+	int request[2], response[2];
+	if ( pipe2(request,O_CLOEXEC) ) {
+		log_error("Creating co-process pipe (%s)",strerror(errno));
+		return NULL;
+	}
+	if ( pipe2(response,O_CLOEXEC) ) {
+		log_error("Creating co-process pipe (%s)",strerror(errno));
+		close(request[0]);
+		close(request[1]);
+		return NULL;
+	}
+	pid_t pid = command_spawn(cs->command,NULL,request[0],response[1]);
+	close(request[0]);
+	close(response[1]);
+	if ( pid < 0 ) {
+		close(request[1]);
+		close(response[0]);
+		return NULL;
+	}
+	coproc_t *rv = calloc(1,sizeof(coproc_t));
+	rv->pid = pid;
+	rv->requests = fdopen(request[1],"w");
+	rv->responses = fdopen(response[0],"r");
+	log_debug("Co-process %d started: %s",pid,cs->command->text);
+	return rv;
+}
+
+static void coproc_stop( coproc_t *c, int sig ) {
+	fclose(c->requests); // end of file, so it can exit
+	fclose(c->responses);
+	if ( sig )
+		kill(c->pid,sig);
+	waitpid(c->pid,NULL,0);
+	free(c);
+}
+
+/*
+ * Take an idle co-process, starting one if there are fewer than allowed.
+ * Waits for one if not. Returns NULL if one couldn't be started.
+ */
+static coproc_t *coprocs_acquire( coprocs_t *cs ) {
+	coproc_t *rv = NULL;
+	pthread_mutex_lock(&cs->lock);
+	while ( !cs->idle && cs->count >= cs->max )
+		pthread_cond_wait(&cs->available,&cs->lock);
+	if ( cs->idle ) {
+		rv = cs->idle;
+		cs->idle = rv->next;
+		pthread_mutex_unlock(&cs->lock);
+	}
+	else {
+		cs->count++;
+		pthread_mutex_unlock(&cs->lock);
+		if ( !(rv = coproc_start(cs)) ) {
+			pthread_mutex_lock(&cs->lock);
+			cs->count--;
+			pthread_cond_signal(&cs->available);
+			pthread_mutex_unlock(&cs->lock);
+		}
+	}
+	return rv;
+}
+
+// return c to the pool, or discard it if it can't be used again
+static void coprocs_release( coprocs_t *cs, coproc_t *c, int broken ) {
+	if ( broken )
+		coproc_stop(c,SIGKILL);
+	pthread_mutex_lock(&cs->lock);
+	if ( broken ) {
+		cs->count--;
+	}
+	else {
+		c->next = cs->idle;
+		cs->idle = c;
+	}
+	pthread_cond_signal(&cs->available);
+	pthread_mutex_unlock(&cs->lock);
+}
+
+coprocs_t *coprocs_create( command_t *command, int max ) {
+	coprocs_t *rv = calloc(1,sizeof(coprocs_t));
+	rv->command = command;
+	rv->max = max > 0 ? max : 1;
+	pthread_mutex_init(&rv->lock,NULL);
+	pthread_cond_init(&rv->available,NULL);
+	return rv;
+}
+
+int coprocs_run( coprocs_t *cs, const char *src, cmdfs_sink_t sink, void *data ) {
+	if ( strchr(src,'\n') ) {
+		log_error("Can't send %s to a co-process, its name contains a newline",src);
+		return -1;
+	}
+	coproc_t *c = coprocs_acquire(cs);
+	if ( !c )
+		return -1;
+	int status = -1;
+	int failed = 0;
+	int broken = fprintf(c->requests,"%s\n",src) < 0 || fflush(c->requests);
+	while ( !broken ) {
+		char line[COUNT_MAX];
+		char *end;
+		long count;
+		if ( !fgets(line,sizeof(line),c->responses) ||
+			 (count = strtol(line,&end,10), end == line || *end != '\n') ) {
+			broken = 1;
+			break;
+		}
+		if ( count <= 0 ) {
+			status = -count;
+			break;
+		}
+		char buf[CHUNK_BUFFER];
+		while ( count > 0 ) {
+			size_t n = fread(buf,1,count < (long)sizeof(buf) ? (size_t)count : sizeof(buf),c->responses);
+			if ( !n ) {
+				broken = 1;
+				break;
+			}
+			if ( !failed && sink(data,buf,n) )
+				failed = 1; // keep reading, the rest of the reply must be consumed
+			count -= n;
+		}
+	}
+	if ( broken ) {
+		log_error("Co-process %d failed on %s (%s)",c->pid,src,ferror(c->responses) || ferror(c->requests) ? strerror(errno) : "protocol error or exit");
+		status = -1;
+	}
+	coprocs_release(cs,c,broken);
+	return failed && !status ? -1 : status;
+}
+
+/*
+ * Destroy cs, once nothing is using its co-processes
+ */
+void coprocs_destroy( coprocs_t *cs ) {
+	while ( cs->idle ) {
+		coproc_t *c = cs->idle;
+		cs->idle = c->next;
+		coproc_stop(c,SIGTERM);
+	}
+	pthread_mutex_destroy(&cs->lock);
+	pthread_cond_destroy(&cs->available);
+	free(cs);
+}
@@ -0,0 +1,152 @@
+/*
+	Cmdfs2 : dedup.c
+
+	Content addressed cache. Outputs are also kept as blobs named by a hash of
+	the source content and the command, and each path's cache file is a hard
+	link to its blob. A source identical to one already transformed just gets
+	a new link. Blobs are reference counted by their link count: once only the
+	blob's own name is left the cleaner removes it.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <fcntl.h>
+#include <sys/xattr.h>
+#include <limits.h>
+
+extern options_t options;
+
+/*
+ * Return the blob path for f's current source content, or NULL if the source
+ * can't be read. Remembered in f.
+ */
+static const char *dedup_blob_path( vfile_t *f ) {
+	if ( !f->blob ) {
+		int fd = open(file_get_src(f),O_RDONLY);
+		uint64_t h[2];
+		if ( fd < 0 || hash_content(fd,h) ) {
+			log_error("Hashing source file %s (%s)",file_get_src(f),strerror(errno));
+		}
+		else {
+			// mix in the command, the same content under another command is another blob
+			uint64_t c[2];
+			hash_string(file_get_command(f),c);
+			char *name = shard_name(h[0] ^ c[0],h[1] ^ c[1]);
+			if ( asprintf(&f->blob,"%s/%s/%s",options.cache_dir,BLOB_DIR,name) < 0 )
+				f->blob = NULL;
+			free(name);
+		}
+		if ( fd >= 0 )
+			close(fd);
+	}
+	return f->blob;
+}
+
+// record the blob's name, relative to the cache directory, on its inode
+static void dedup_tag( const char *blob ) {
+	const char *name = blob+strlen(options.cache_dir)+1;
+	setxattr(blob,BLOB_XATTR,name,strlen(name),0);
+}
+
+/*
+ * Atomically make f's cache file a link to blob
+ */
+static int dedup_link( vfile_t *f, const char *blob ) {
+	const char *cached = file_get_cached_path(f);
+	char tmp[strlen(cached)+sizeof(LINK_SUFFIX)];
+	sprintf(tmp,"%s%s",cached,LINK_SUFFIX);
+	unlink(tmp); // left over from a crash
+	int err = link(blob,tmp);
+	if ( err && errno == ENOENT ) {
+		make_parents(tmp,options.cache_dir); // first in this shard
+		err = link(blob,tmp);
+	}
+	if ( err )
+		return -1;
+	if ( rename(tmp,cached) ) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * If the output for f's content already exists, link f's cache file to it.
+ * Returns 1 if so, meaning f is now cached, 0 if f must be transformed.
+ */
+int dedup_fetch( vfile_t *f ) {
+	const char *blob = dedup_blob_path(f);
+	struct stat st;
+	if ( !blob || stat(blob,&st) || !S_ISREG(st.st_mode) )
+		return 0;
+	if ( dedup_link(f,blob) ) {
+		log_debug("Linking %s to %s (%s)",file_get_cached_path(f),blob,strerror(errno));
+		return 0;
+	}
+	// shared output is as new as the newest source it stands for, so it isn't seen as stale
+	utimensat(AT_FDCWD,blob,NULL,0);
+	dedup_tag(blob);
+	log_debug("Reused output %s for %s",blob,file_get_dest(f));
+	return 1;
+}
+
+/*
+ * Keep f's newly generated cache file as the blob for its content. If another
+ * file got there first, share its blob instead.
+ */
+void dedup_store( vfile_t *f ) {
+	const char *blob = dedup_blob_path(f);
+	const char *cached = file_get_cached_path(f);
+	if ( !blob )
+		return;
+	int err = link(cached,blob);
+	if ( err && errno == ENOENT ) {
+		make_parents(blob,options.cache_dir); // first in this shard
+		err = link(cached,blob);
+	}
+	if ( err && errno == EEXIST ) {
+		struct stat sc, sb;
+		if ( !stat(cached,&sc) && !stat(blob,&sb) && sc.st_ino != sb.st_ino )
+			dedup_link(f,blob);
+	}
+	else if ( err ) {
+		log_warning("Storing output of %s as %s (%s)",file_get_dest(f),blob,strerror(errno));
+		return;
+	}
+	dedup_tag(blob);
+}
+
+/*
+ * Cache file cached is about to be removed, remove its blob too if nothing
+ * else links to it. Blobs not found this way are left to the cleaner's rescan.
+ */
+void dedup_release_cached( const char *cached ) {
+	struct stat st;
+	char name[PATH_MAX];
+	ssize_t length;
+	if ( !stat(cached,&st) && st.st_nlink == 2 && // just this and its blob
+		 (length = getxattr(cached,BLOB_XATTR,name,sizeof(name)-1)) > 0 ) {
+		name[length] = '\0';
+		char blob[strlen(options.cache_dir)+length+2];
+		sprintf(blob,"%s/%s",options.cache_dir,name);
+		unlink(blob);
+	}
+}
+
+void dedup_release( vfile_t *f ) {
+	dedup_release_cached(file_get_cached_path(f));
+}
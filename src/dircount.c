@@ -0,0 +1,317 @@
+/*
+	Cmdfs2 : dircount.c
+
+	Counts of matching files per source directory, used to hide empty
+	directories. Each directory is scanned once, then rescanned only when it
+	changes - as reported by the monitor if it watches the directory, or as
+	seen from its mtime otherwise. Directories are read and their files
+	matched without the lock, which is held only to update the counts.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <pthread.h>
+
+extern options_t options;
+extern monitor_t *monitor;
+
+// what scanning a directory found, gathered without the lock
+typedef struct {
+	struct timespec mtime;
+	long direct;
+	char **subdirs;
+	int count;
+	int size;
+} scan_t;
+
+// directories still to be scanned
+typedef struct {
+	char **paths;
+	int count;
+	int size;
+} worklist_t;
+
+static int file_matches( const char *path ) {
+	if ( options.link_thru )
+		return 1; // there is a regular file and linked thru, so not empty
+	vfile_t *f = file_create_from_src(path);
+	int rv = file_get_command(f) != NULL; // virtual file is to be generated so not empty
+	file_destroy(f);
+	return rv;
+}
+
+static void paths_add( char ***paths, int *count, int *size, const char *path ) {
+	if ( *count >= *size ) {
+		*size = *size ? *size * 2 : 16;
+		*paths = realloc(*paths,*size * sizeof(char *));
+	}
+	(*paths)[(*count)++] = strdup(path);
+}
+
+// adjust the totals of n and its ancestors
+static void dircount_adjust( dnode_t *n, long delta, long pending ) {
+	for ( ; n && (delta || pending); n = n->parent ) {
+		n->total += delta;
+		n->pending += pending;
+	}
+}
+
+static dnode_t *dircount_node_create( dircount_t *d, const char *path ) {
+	dnode_t *rv = calloc(1,sizeof(dnode_t));
+	rv->path = strdup(path);
+	rv->uncounted = 1;
+	rv->pending = 1; // until scanned
+	htable_put(d->nodes,rv->path,rv);
+	return rv;
+}
+
+// remove n and its descendants, call with lock held
+static void dircount_node_destroy( dircount_t *d, dnode_t *n ) {
+	while ( n->child ) {
+		dnode_t *c = n->child;
+		n->child = c->sibling;
+		dircount_node_destroy(d,c);
+	}
+	if ( n->dirty ) {
+		for ( dnode_t **p = &d->dirty; *p; p = &(*p)->next_dirty ) {
+			if ( *p == n ) {
+				*p = n->next_dirty;
+				break;
+			}
+		}
+	}
+	htable_remove(d->nodes,n->path);
+	free(n->path);
+	free(n);
+}
+
+static void dircount_link( dnode_t *parent, dnode_t *child ) {
+	child->parent = parent;
+	child->sibling = parent->child;
+	parent->child = child;
+	dircount_adjust(parent,child->total,child->pending);
+}
+
+static void dircount_unlink( dnode_t *child ) {
+	if ( child->parent ) {
+		for ( dnode_t **p = &child->parent->child; *p; p = &(*p)->sibling ) {
+			if ( *p == child ) {
+				*p = child->sibling;
+				break;
+			}
+		}
+		dircount_adjust(child->parent,-child->total,-child->pending);
+		child->parent = NULL;
+	}
+}
+
+static int dircount_read_visitor( const dir_info *visit, void *data ) {
+	scan_t *s = (scan_t *)data;
+	if ( S_ISREG(visit->mode) )
+		s->direct += file_matches(visit->path);
+	else if ( S_ISDIR(visit->mode) && strcmp(visit->name,".") && strcmp(visit->name,"..") )
+		paths_add(&s->subdirs,&s->count,&s->size,visit->path);
+	return 0;
+}
+
+// count the files directly in path and find its subdirectories, without the lock
+static void dircount_read( const char *path, scan_t *s ) {
+	struct stat st;
+	memset(s,0,sizeof(scan_t));
+	if ( !stat(path,&st) )
+		s->mtime = st.st_mtim;
+	dir_visit(path,0,dircount_read_visitor,s);
+}
+
+/*
+ * Update the node for path from what was read of it. New subdirectories are
+ * added uncounted, to be scanned from work. Call with lock held
+ */
+static void dircount_publish( dircount_t *d, const char *path, scan_t *s, worklist_t *work ) {
+	dnode_t *n = htable_get(d->nodes,path);
+	if ( !n )
+		return; // dropped meanwhile, its parent rescanned
+	htable_t *found = htable_create(str_hash,str_equal);
+	for ( int i = 0; i < s->count; i++ )
+		htable_put(found,s->subdirs[i],s->subdirs[i]);
+	dnode_t *next;
+	for ( dnode_t *c = n->child; c; c = next ) {
+		next = c->sibling;
+		if ( htable_remove(found,c->path) )
+			continue; // still there, keeps its counts
+		dircount_unlink(c); // gone since last scan
+		dircount_node_destroy(d,c);
+	}
+	for ( int i = 0; i < s->count; i++ ) {
+		if ( !htable_get(found,s->subdirs[i]) )
+			continue;
+		// adopt a node counted on its own, or count a new one
+		dnode_t *c = htable_get(d->nodes,s->subdirs[i]);
+		if ( c )
+			dircount_unlink(c);
+		else {
+			c = dircount_node_create(d,s->subdirs[i]);
+			paths_add(&work->paths,&work->count,&work->size,c->path);
+		}
+		dircount_link(n,c);
+	}
+	htable_destroy(found);
+	n->mtime = s->mtime;
+	dircount_adjust(n,s->direct - n->direct,n->uncounted ? -1 : 0);
+	n->direct = s->direct;
+	n->uncounted = 0;
+}
+
+/*
+ * (Re)count the files directly in path, counting any new subdirectories in
+ * full. Totals of its node and ancestors are adjusted. Call with lock held,
+ * it's released while directories are read.
+ */
+static void dircount_scan( dircount_t *d, const char *path ) {
+	worklist_t work = { NULL, 0, 0 };
+	paths_add(&work.paths,&work.count,&work.size,path);
+	while ( work.count ) {
+		char *next = work.paths[--work.count];
+		scan_t s;
+		pthread_mutex_unlock(&d->lock);
+		dircount_read(next,&s);
+		pthread_mutex_lock(&d->lock);
+		dircount_publish(d,next,&s,&work);
+		for ( int i = 0; i < s.count; i++ )
+			free(s.subdirs[i]);
+		free(s.subdirs);
+		free(next);
+	}
+	free(work.paths);
+	pthread_cond_broadcast(&d->counted);
+}
+
+static void dircount_flush( dircount_t *d ) {
+	while ( d->dirty ) {
+		dnode_t *n = d->dirty;
+		d->dirty = n->next_dirty;
+		n->dirty = 0;
+		char path[strlen(n->path)+1];
+		strcpy(path,n->path);
+		dircount_scan(d,path);
+	}
+}
+
+/*
+ * Unwatched - rescan path if its mtime has moved and return whether it or any
+ * descendant has a matching file, checking only as far as needed. Call with
+ * lock held
+ */
+static int dircount_validate( dircount_t *d, const char *path ) {
+	struct stat st;
+	dnode_t *n = htable_get(d->nodes,path);
+	if ( n && (stat(path,&st) || st.st_mtim.tv_sec != n->mtime.tv_sec || st.st_mtim.tv_nsec != n->mtime.tv_nsec) ) {
+		dircount_scan(d,path);
+		n = htable_get(d->nodes,path);
+	}
+	if ( !n )
+		return 0;
+	if ( n->direct > 0 )
+		return 1;
+	// by path, as the children may change while others are scanned
+	char **children = NULL;
+	int count = 0, size = 0, rv = 0;
+	for ( dnode_t *c = n->child; c; c = c->sibling )
+		paths_add(&children,&count,&size,c->path);
+	for ( int i = 0; i < count; i++ ) {
+		if ( !rv )
+			rv = dircount_validate(d,children[i]);
+		free(children[i]);
+	}
+	free(children);
+	return rv;
+}
+
+dircount_t *dircount_create() {
+	dircount_t *rv = calloc(1,sizeof(dircount_t));
+	rv->nodes = htable_create(str_hash,str_equal);
+	pthread_mutex_init(&rv->lock,NULL);
+	pthread_cond_init(&rv->counted,NULL);
+	return rv;
+}
+
+/*
+ * Copy path to buf without repeated or trailing '/', so paths built by
+ * dir_visit() and from FUSE agree
+ */
+static const char *dircount_key( const char *path, char *buf ) {
+	char *d = buf;
+	for ( const char *s = path; *s; s++ ) {
+		if ( *s != '/' || d == buf || d[-1] != '/' )
+			*d++ = *s;
+	}
+	if ( d > buf+1 && d[-1] == '/' )
+		d--;
+	*d = '\0';
+	return buf;
+}
+
+int dircount_is_empty( dircount_t *d, const char *path ) {
+	int rv;
+	char key[strlen(path)+1];
+	dircount_key(path,key);
+	pthread_mutex_lock(&d->lock);
+	dircount_flush(d); // catch up with changes reported since last time
+	dnode_t *n = htable_get(d->nodes,key);
+	if ( !n ) {
+		dircount_node_create(d,key);
+		dircount_scan(d,key);
+	}
+	else if ( !monitor_watching(monitor,key,1) && dircount_validate(d,key) ) {
+		pthread_mutex_unlock(&d->lock);
+		return 0;
+	}
+	// wait for any of it being counted by others
+	while ( (n = htable_get(d->nodes,key)) && !n->total && n->pending )
+		pthread_cond_wait(&d->counted,&d->lock);
+	rv = !n || !n->total;
+	pthread_mutex_unlock(&d->lock);
+	return rv;
+}
+
+void dircount_changed( dircount_t *d, const char *path ) {
+	char key[strlen(path)+1];
+	dircount_key(path,key);
+	pthread_mutex_lock(&d->lock);
+	dnode_t *n = htable_get(d->nodes,key);
+	if ( n && !n->dirty ) {
+		n->dirty = 1;
+		n->next_dirty = d->dirty;
+		d->dirty = n;
+	}
+	pthread_mutex_unlock(&d->lock);
+}
+
+static int dircount_destroy_visitor( const void *key, void *value, void *data ) {
+	dnode_t *n = (dnode_t *)value;
+	free(n->path);
+	free(n);
+	return 0;
+}
+
+void dircount_destroy( dircount_t *d ) {
+	htable_visit(d->nodes,dircount_destroy_visitor,NULL);
+	htable_destroy(d->nodes);
+	pthread_mutex_destroy(&d->lock);
+	pthread_cond_destroy(&d->counted);
+	free(d);
+}
@@ -0,0 +1,163 @@
+/*
+	Cmdfs2 : htable.c
+
+	Simple chained hash table, keyed by string or integer
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <stdint.h>
+
+#define HTABLE_INITIAL_SIZE 64	// buckets, always a power of 2
+
+/*
+ * FNV-1a string hash
+ */
+unsigned long str_hash( const void *key ) {
+	unsigned long h = 14695981039346656037UL;
+	for ( const unsigned char *s = key; *s; s++ ) {
+		h ^= *s;
+		h *= 1099511628211UL;
+	}
+	return h;
+}
+
+int str_equal( const void *a, const void *b ) {
+	return !strcmp((const char *)a,(const char *)b);
+}
+
+/*
+ * Integer keys are stored directly in the key pointer
+ */
+unsigned long int_hash( const void *key ) {
+	unsigned long h = (uintptr_t)key;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+	return h;
+}
+
+int int_equal( const void *a, const void *b ) {
+	return a == b;
+}
+
+htable_t *htable_create( unsigned long (*hash)(const void *), int (*equal)(const void *, const void *) ) {
+	htable_t *rv = calloc(1,sizeof(htable_t));
+	rv->size = HTABLE_INITIAL_SIZE;
+	rv->buckets = calloc(rv->size,sizeof(hnode_t *));
+	rv->hash = hash;
+	rv->equal = equal;
+	return rv;
+}
+
+static hnode_t **htable_find( htable_t *h, const void *key, unsigned long hash ) {
+	hnode_t **n = h->buckets + (hash & (h->size-1));
+	while ( *n && ((*n)->hash != hash || !h->equal((*n)->key,key)) )
+		n = &(*n)->next;
+	return n;
+}
+
+static void htable_grow( htable_t *h ) {
+	unsigned long size = h->size * 2;
+	hnode_t **buckets = calloc(size,sizeof(hnode_t *));
+	if ( !buckets )
+		return; // carry on with longer chains
+	for ( unsigned long i = 0; i < h->size; i++ ) {
+		hnode_t *n = h->buckets[i];
+		while ( n ) {
+			hnode_t *next = n->next;
+			n->next = buckets[n->hash & (size-1)];
+			buckets[n->hash & (size-1)] = n;
+			n = next;
+		}
+	}
+	free(h->buckets);
+	h->buckets = buckets;
+	h->size = size;
+}
+
+void *htable_get( htable_t *h, const void *key ) {
+	hnode_t *n = *htable_find(h,key,h->hash(key));
+	return n ? n->value : NULL;
+}
+
+void *htable_put( htable_t *h, const void *key, void *value ) {
+	unsigned long hash = h->hash(key);
+	hnode_t **n = htable_find(h,key,hash);
+	void *rv = NULL;
+	if ( *n ) {
+		rv = (*n)->value;
+		(*n)->key = key; // old key may be owned by the old value
+		(*n)->value = value;
+	}
+	else {
+		hnode_t *node = malloc(sizeof(hnode_t));
+		node->hash = hash;
+		node->key = key;
+		node->value = value;
+		node->next = NULL;
+		*n = node;
+		if ( ++h->count > h->size )
+			htable_grow(h);
+	}
+	return rv;
+}
+
+void *htable_remove( htable_t *h, const void *key ) {
+	hnode_t **n = htable_find(h,key,h->hash(key));
+	void *rv = NULL;
+	if ( *n ) {
+		hnode_t *node = *n;
+		rv = node->value;
+		*n = node->next;
+		free(node);
+		h->count--;
+	}
+	return rv;
+}
+
+/*
+ * Call visitor for each entry. If the visitor returns non-zero the visit is
+ * aborted and that value returned. The visitor may remove the entry it is
+ * passed but no other.
+ */
+int htable_visit( htable_t *h, int (*visitor)(const void *key, void *value, void *data), void *data ) {
+	for ( unsigned long i = 0; i < h->size; i++ ) {
+		hnode_t *n = h->buckets[i];
+		while ( n ) {
+			hnode_t *next = n->next;
+			int rv = visitor(n->key,n->value,data);
+			if ( rv )
+				return rv;
+			n = next;
+		}
+	}
+	return 0;
+}
+
+void htable_destroy( htable_t *h ) {
+	for ( unsigned long i = 0; i < h->size; i++ ) {
+		hnode_t *n = h->buckets[i];
+		while ( n ) {
+			hnode_t *next = n->next;
+			free(n);
+			n = next;
+		}
+	}
+	free(h->buckets);
+	free(h);
+}
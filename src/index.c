@@ -0,0 +1,402 @@
+/*
+	Cmdfs2 : index.c
+
+	Cache metadata index. Records, for each cached file, the source file
+	attributes it was generated from and the size of the output so a stat of
+	a warm entry needs nothing more than a stat of the source. The index is
+	saved in the cache directory so it survives remounts, and periodically
+	while changed so little is lost if cmdfs doesn't exit cleanly.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+
+#define INDEX_MAGIC "CMDFSIX2" // 2: sharded cache file names
+#define INDEX_SAVE_INTERVAL 60 // secs between saves of a changed index
+
+extern options_t options;
+
+// On disk record, followed by path and cached name (not null terminated)
+typedef struct {
+	uint64_t src_ino;
+	int64_t src_mtime_sec;
+	int64_t src_mtime_nsec;
+	int64_t src_size;
+	int64_t size;
+	int64_t created;
+	uint32_t path_len;
+	uint32_t cached_len;
+} index_record_t;
+
+static void index_entry_destroy( index_entry_t *e ) {
+	free(e->path);
+	free(e->cached);
+	free(e);
+}
+
+static index_entry_t *index_entry_create( const char *path, const char *cached ) {
+	index_entry_t *rv = calloc(1,sizeof(index_entry_t));
+	rv->path = strdup(path);
+	rv->cached = strdup(cached);
+	return rv;
+}
+
+// add e, replacing any entry for the same path. Call with lock held
+static void index_insert( index_t *x, index_entry_t *e ) {
+	index_entry_t *old = htable_put(x->entries,e->path,e);
+	if ( old ) {
+		if ( htable_get(x->by_cached,old->cached) == old )
+			htable_remove(x->by_cached,old->cached);
+		index_entry_destroy(old);
+	}
+	htable_put(x->by_cached,e->cached,e);
+	x->generation++;
+}
+
+static int index_destroy_visitor( const void *key, void *value, void *data ) {
+	index_entry_destroy((index_entry_t *)value);
+	return 0;
+}
+
+// bytes of in still to read, for checking lengths read from it
+static long index_remaining( FILE *in ) {
+	struct stat st;
+	long pos = ftell(in);
+	return fstat(fileno(in),&st) || pos < 0 ? 0 : st.st_size - pos;
+}
+
+static void index_load( index_t *x ) {
+	FILE *in = fopen(x->file,"r");
+	if ( !in ) {
+		if ( errno != ENOENT )
+			log_warning("Unable to read cache index %s (%s)",x->file,strerror(errno));
+		return;
+	}
+	char magic[sizeof(INDEX_MAGIC)-1];
+	uint32_t command_len;
+	int loaded = 0;
+	int corrupt = 0;
+	if ( fread(magic,sizeof(magic),1,in) == 1 && !memcmp(magic,INDEX_MAGIC,sizeof(magic)) &&
+		 fread(&command_len,sizeof(command_len),1,in) == 1 ) {
+		char *command = command_len <= index_remaining(in) ? malloc(command_len+1) : NULL;
+		if ( !command )
+			corrupt = 1;
+		else if ( fread(command,command_len,1,in) == 1 || !command_len ) {
+			command[command_len] = '\0';
+			if ( strcmp(command,options.command) ) {
+				// outputs were generated by some other command, don't trust them
+				log_debug("Cache index %s was for command %s, discarded",x->file,command);
+			}
+			else {
+				index_record_t r;
+				char path[PATH_MAX+1];
+				char cached[PATH_MAX+1];
+				while ( fread(&r,sizeof(r),1,in) == 1 ) {
+					if ( r.path_len > PATH_MAX || r.cached_len > PATH_MAX ||
+						 r.path_len + r.cached_len > index_remaining(in) ||
+						 fread(path,r.path_len,1,in) != 1 || fread(cached,r.cached_len,1,in) != 1 ) {
+						corrupt = 1;
+						break;
+					}
+					path[r.path_len] = cached[r.cached_len] = '\0';
+					index_entry_t *e = index_entry_create(path,cached);
+					e->src_ino = r.src_ino;
+					e->src_mtime.tv_sec = r.src_mtime_sec;
+					e->src_mtime.tv_nsec = r.src_mtime_nsec;
+					e->src_size = r.src_size;
+					e->size = r.size;
+					e->created = r.created;
+					e->verified = 0; // matching rules may have changed since
+					index_insert(x,e);
+					loaded++;
+				}
+			}
+		}
+		free(command);
+	}
+	else
+		log_warning("Cache index %s not recognised, ignored",x->file);
+	fclose(in);
+	if ( corrupt ) {
+		// nothing in it can be trusted, outputs are checked the slow way instead
+		log_warning("Cache index %s truncated or corrupt, discarded",x->file);
+		htable_visit(x->entries,index_destroy_visitor,NULL);
+		htable_destroy(x->entries);
+		htable_destroy(x->by_cached);
+		x->entries = htable_create(str_hash,str_equal);
+		x->by_cached = htable_create(str_hash,str_equal);
+		x->dirty = 1; // replaced at the next save
+		loaded = 0;
+	}
+	log_debug("Loaded %d entries from cache index %s",loaded,x->file);
+}
+
+static int index_save_visitor( const void *key, void *value, void *data ) {
+	index_entry_t *e = (index_entry_t *)value;
+	index_record_t r = {
+		.src_ino = e->src_ino,
+		.src_mtime_sec = e->src_mtime.tv_sec,
+		.src_mtime_nsec = e->src_mtime.tv_nsec,
+		.src_size = e->src_size,
+		.size = e->size,
+		.created = e->created,
+		.path_len = strlen(e->path),
+		.cached_len = strlen(e->cached)
+	};
+	FILE *out = (FILE *)data;
+	return fwrite(&r,sizeof(r),1,out) != 1 ||
+		fwrite(e->path,r.path_len,1,out) != 1 ||
+		fwrite(e->cached,r.cached_len,1,out) != 1;
+}
+
+/*
+ * Write index to disk, replacing the previous copy atomically. It's
+ * serialised to memory under the lock, so lookups wait no longer than that.
+ */
+int index_save( index_t *x ) {
+	int rv = 0;
+	char *buf = NULL;
+	size_t len = 0;
+	pthread_mutex_lock(&x->lock);
+	int dirty = x->dirty;
+	if ( dirty ) {
+		FILE *mem = open_memstream(&buf,&len);
+		uint32_t command_len = strlen(options.command);
+		if ( !mem ||
+			 fwrite(INDEX_MAGIC,sizeof(INDEX_MAGIC)-1,1,mem) != 1 ||
+			 fwrite(&command_len,sizeof(command_len),1,mem) != 1 ||
+			 fwrite(options.command,command_len,1,mem) != 1 ||
+			 htable_visit(x->entries,index_save_visitor,mem) )
+			rv = -1;
+		if ( mem && fclose(mem) )
+			rv = -1;
+		x->dirty = 0; // set again by changes from now on
+	}
+	pthread_mutex_unlock(&x->lock);
+	if ( !dirty )
+		return 0;
+	char tmp[strlen(x->file)+5];
+	sprintf(tmp,"%s.tmp",x->file);
+	FILE *out = rv ? NULL : fopen(tmp,"w");
+	if ( out ) {
+		if ( fwrite(buf,len,1,out) != 1 && len )
+			rv = -1;
+		if ( fclose(out) )
+			rv = -1;
+		if ( !rv && rename(tmp,x->file) )
+			rv = -1;
+		if ( rv )
+			unlink(tmp);
+	}
+	else
+		rv = -1;
+	free(buf);
+	if ( rv ) {
+		log_error("Failed to save cache index %s (%s)",x->file,strerror(errno));
+		pthread_mutex_lock(&x->lock);
+		x->dirty = 1; // try again next time
+		pthread_mutex_unlock(&x->lock);
+	}
+	else
+		log_debug("Saved cache index %s",x->file);
+	return rv;
+}
+
+// saves the index while it's changed, until index_destroy()
+static void *index_saver( void *_x ) {
+	index_t *x = (index_t *)_x;
+	pthread_mutex_lock(&x->lock);
+	while ( !x->stop ) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME,&until);
+		until.tv_sec += INDEX_SAVE_INTERVAL;
+		pthread_cond_timedwait(&x->wake,&x->lock,&until);
+		if ( !x->stop && x->dirty ) {
+			pthread_mutex_unlock(&x->lock);
+			index_save(x);
+			pthread_mutex_lock(&x->lock);
+		}
+	}
+	pthread_mutex_unlock(&x->lock);
+	return NULL;
+}
+
+index_t *index_create( const char *file ) {
+	index_t *rv = calloc(1,sizeof(index_t));
+	rv->file = strdup(file);
+	rv->entries = htable_create(str_hash,str_equal);
+	rv->by_cached = htable_create(str_hash,str_equal);
+	pthread_mutex_init(&rv->lock,NULL);
+	pthread_cond_init(&rv->wake,NULL);
+	index_load(rv);
+	int rc = pthread_create(&rv->saver,NULL,index_saver,rv);
+	if ( rc )
+		log_warning("Cache index %s saved only at unmount (%s)",file,strerror(rc));
+	else
+		rv->saving = 1;
+	return rv;
+}
+
+/*
+ * Look up the output size of path, given the current attributes of its
+ * source file. Returns 1 (and sets *size) if there's an entry and it is
+ * still valid, -1 (and sets *size) if it is valid but was loaded from disk and
+ * so needs index_verify() once the path is known to still match, 0 if the file
+ * must be (re)checked the slow way.
+ */
+int index_lookup( index_t *x, const char *path, const struct stat *src, off_t *size ) {
+	int rv = 0;
+	pthread_mutex_lock(&x->lock);
+	index_entry_t *e = htable_get(x->entries,path);
+	if ( e &&
+		 e->src_ino == src->st_ino &&
+		 e->src_size == src->st_size &&
+		 e->src_mtime.tv_sec == src->st_mtim.tv_sec &&
+		 e->src_mtime.tv_nsec == src->st_mtim.tv_nsec &&
+		 (options.cache_expiry < 0 || (time(NULL) - e->created) <= options.cache_expiry) ) {
+		*size = e->size;
+		rv = e->verified ? 1 : -1;
+	}
+	pthread_mutex_unlock(&x->lock);
+	return rv;
+}
+
+/*
+ * Record that path, with source attributes src, is cached as cached (relative
+ * to the cache directory) with attributes out
+ */
+void index_update( index_t *x, const char *path, const char *cached, const struct stat *src, const struct stat *out ) {
+	index_entry_t *e = index_entry_create(path,cached);
+	e->src_ino = src->st_ino;
+	e->src_mtime = src->st_mtim;
+	e->src_size = src->st_size;
+	e->size = out->st_size;
+	e->created = out->st_mtime;
+	e->verified = 1;
+	pthread_mutex_lock(&x->lock);
+	index_insert(x,e);
+	x->dirty = 1;
+	pthread_mutex_unlock(&x->lock);
+}
+
+/*
+ * Mark the entry for path as good for this session
+ */
+void index_verify( index_t *x, const char *path ) {
+	pthread_mutex_lock(&x->lock);
+	index_entry_t *e = htable_get(x->entries,path);
+	if ( e )
+		e->verified = 1;
+	pthread_mutex_unlock(&x->lock);
+}
+
+static void index_delete( index_t *x, index_entry_t *e ) {
+	htable_remove(x->entries,e->path);
+	if ( htable_get(x->by_cached,e->cached) == e )
+		htable_remove(x->by_cached,e->cached);
+	index_entry_destroy(e);
+	x->dirty = 1;
+	x->generation++;
+}
+
+void index_remove( index_t *x, const char *path ) {
+	pthread_mutex_lock(&x->lock);
+	index_entry_t *e = htable_get(x->entries,path);
+	if ( e )
+		index_delete(x,e);
+	pthread_mutex_unlock(&x->lock);
+}
+
+void index_remove_cached( index_t *x, const char *cached ) {
+	pthread_mutex_lock(&x->lock);
+	index_entry_t *e = htable_get(x->by_cached,cached);
+	if ( e )
+		index_delete(x,e);
+	pthread_mutex_unlock(&x->lock);
+}
+
+/*
+ * Return a count that changes whenever entries are added or removed
+ */
+unsigned long index_generation( index_t *x ) {
+	pthread_mutex_lock(&x->lock);
+	unsigned long rv = x->generation;
+	pthread_mutex_unlock(&x->lock);
+	return rv;
+}
+
+typedef struct {
+	htable_t *dirs;
+	char **paths;
+	int count;
+	int size;
+} index_in_t;
+
+static int index_in_visitor( const void *key, void *value, void *data ) {
+	index_in_t *in = (index_in_t *)data;
+	const char *path = (const char *)key;
+	const char *slash = strrchr(path,'/');
+	char dir[slash ? slash-path+1 : 1];
+	snprintf(dir,sizeof(dir),"%s",slash ? path : "");
+	if ( htable_get(in->dirs,dir) ) {
+		if ( in->count+1 >= in->size ) {
+			in->size *= 2;
+			in->paths = realloc(in->paths,in->size * sizeof(char *));
+		}
+		in->paths[in->count++] = strdup(path);
+	}
+	return 0;
+}
+
+/*
+ * Return the paths of entries for files directly in any of the set of
+ * directories dirs, as a NULL terminated list for the caller to free
+ */
+char **index_paths_in( index_t *x, htable_t *dirs ) {
+	index_in_t in = { .dirs = dirs, .size = 64 };
+	in.paths = malloc(in.size * sizeof(char *));
+	pthread_mutex_lock(&x->lock);
+	htable_visit(x->entries,index_in_visitor,&in);
+	pthread_mutex_unlock(&x->lock);
+	in.paths[in.count] = NULL;
+	return in.paths;
+}
+
+/*
+ * Save and destroy index x
+ */
+void index_destroy( index_t *x ) {
+	if ( x->saving ) {
+		pthread_mutex_lock(&x->lock);
+		x->stop = 1;
+		pthread_cond_signal(&x->wake);
+		pthread_mutex_unlock(&x->lock);
+		pthread_join(x->saver,NULL);
+	}
+	index_save(x);
+	htable_visit(x->entries,index_destroy_visitor,NULL);
+	htable_destroy(x->entries);
+	htable_destroy(x->by_cached);
+	pthread_mutex_destroy(&x->lock);
+	pthread_cond_destroy(&x->wake);
+	free((void *)x->file);
+	free(x);
+}
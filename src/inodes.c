@@ -0,0 +1,162 @@
+/*
+	Cmdfs2 : inodes.c
+
+	Inode numbers given to the kernel for the paths it looks up, so requests
+	on a file are a table lookup rather than a path walk. Each is tied to the
+	source file's inode, and a path whose source is replaced gets a new one.
+	Entries are kept until the kernel forgets them. The kernel can be told
+	to drop what it has cached about a path, when the monitor sees it change.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <pthread.h>
+
+static inode_t *inode_create( inodes_t *t, unsigned long ino, const char *path, ino_t src_ino ) {
+	inode_t *rv = calloc(1,sizeof(inode_t));
+	rv->ino = ino;
+	rv->path = strdup(path);
+	rv->src_ino = src_ino;
+	rv->current = 1;
+	htable_put(t->by_ino,(void *)rv->ino,rv);
+	htable_put(t->by_path,rv->path,rv);
+	return rv;
+}
+
+// drop n from the paths looked up, call with lock held
+static void inodes_detach( inodes_t *t, inode_t *n ) {
+	if ( n->current ) {
+		htable_remove(t->by_path,n->path);
+		n->current = 0;
+	}
+}
+
+inodes_t *inodes_create( void (*invalidate)(unsigned long ino, const char *name) ) {
+	inodes_t *rv = calloc(1,sizeof(inodes_t));
+	rv->by_ino = htable_create(int_hash,int_equal);
+	rv->by_path = htable_create(str_hash,str_equal);
+	rv->invalidate = invalidate;
+	pthread_mutex_init(&rv->lock,NULL);
+	inode_create(rv,INODE_ROOT,"/",0)->lookups = 1; // never forgotten
+	rv->next = INODE_ROOT + 1;
+	return rv;
+}
+
+unsigned long inodes_lookup( inodes_t *t, const char *path, ino_t src_ino ) {
+	pthread_mutex_lock(&t->lock);
+	inode_t *n = htable_get(t->by_path,path);
+	if ( n && n->ino != INODE_ROOT && n->src_ino != src_ino ) {
+		inodes_detach(t,n); // source replaced, still open through the old one maybe
+		n = NULL;
+	}
+	if ( !n )
+		n = inode_create(t,t->next++,path,src_ino);
+	n->lookups++;
+	unsigned long rv = n->ino;
+	pthread_mutex_unlock(&t->lock);
+	return rv;
+}
+
+char *inodes_path( inodes_t *t, unsigned long ino ) {
+	pthread_mutex_lock(&t->lock);
+	inode_t *n = htable_get(t->by_ino,(void *)ino);
+	char *rv = n ? strdup(n->path) : NULL;
+	pthread_mutex_unlock(&t->lock);
+	return rv;
+}
+
+void inodes_forget( inodes_t *t, unsigned long ino, unsigned long lookups ) {
+	pthread_mutex_lock(&t->lock);
+	inode_t *n = htable_get(t->by_ino,(void *)ino);
+	if ( n && n->ino != INODE_ROOT ) {
+		n->lookups = lookups < n->lookups ? n->lookups - lookups : 0;
+		if ( !n->lookups ) {
+			inodes_detach(t,n);
+			htable_remove(t->by_ino,(void *)ino);
+			free(n->path);
+			free(n);
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+static unsigned long inodes_find( inodes_t *t, const char *path ) {
+	pthread_mutex_lock(&t->lock);
+	inode_t *n = htable_get(t->by_path,*path ? path : "/");
+	unsigned long rv = n ? n->ino : 0;
+	pthread_mutex_unlock(&t->lock);
+	return rv;
+}
+
+void inodes_changed( inodes_t *t, const char *path, int ancestors ) {
+	// invalidate is called without the lock, as the kernel may wait on requests that need it
+	char p[strlen(path)+1];
+	strcpy(p,path);
+	unsigned long ino = inodes_find(t,p);
+	if ( ino )
+		t->invalidate(ino,NULL); // its attributes and contents
+	char *name;
+	for ( int first = 1; (name = strrchr(p,'/')) && name[1]; first = 0 ) {
+		*name++ = '\0';
+		unsigned long parent = inodes_find(t,p);
+		if ( !parent )
+			break; // nothing further up is known to the kernel either
+		t->invalidate(parent,name); // the entry, it may have gone or be another file
+		if ( first )
+			t->invalidate(parent,NULL); // mtime and size of the directory
+		if ( !ancestors )
+			break;
+	}
+}
+
+static int inodes_paths_visitor( const void *key, void *value, void *data ) {
+	htable_t *paths = data;
+	char *path = strdup((const char *)key);
+	htable_put(paths,path,path);
+	return 0;
+}
+
+static int inodes_invalidate_visitor( const void *key, void *value, void *data ) {
+	inodes_changed((inodes_t *)data,(const char *)key,0);
+	free(value);
+	return 0;
+}
+
+void inodes_invalidate( inodes_t *t ) {
+	// copied, as the paths may be forgotten once the lock is released
+	htable_t *paths = htable_create(str_hash,str_equal);
+	pthread_mutex_lock(&t->lock);
+	htable_visit(t->by_path,inodes_paths_visitor,paths);
+	pthread_mutex_unlock(&t->lock);
+	htable_visit(paths,inodes_invalidate_visitor,t);
+	htable_destroy(paths);
+}
+
+static int inodes_destroy_visitor( const void *key, void *value, void *data ) {
+	inode_t *n = value;
+	free(n->path);
+	free(n);
+	return 0;
+}
+
+void inodes_destroy( inodes_t *t ) {
+	htable_visit(t->by_ino,inodes_destroy_visitor,NULL);
+	htable_destroy(t->by_ino);
+	htable_destroy(t->by_path);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
@@ -0,0 +1,190 @@
+/*
+	Cmdfs2 : listings.c
+
+	Filtered listings of source directories. Each directory handle reads a
+	listing, and with a cache they are kept and shared so listing a directory
+	again needn't read it or match the command for its files. Cached listings
+	are checked against the directory's mtime, or dropped when the monitor
+	reports a change if it watches the directory. The least recently used
+	are evicted to keep within a memory budget.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <pthread.h>
+
+extern options_t options;
+extern monitor_t *monitor;
+
+listing_t *listing_create( const char *path ) {
+	listing_t *rv = calloc(1,sizeof(listing_t));
+	rv->path = strdup(path);
+	rv->refs = 1;
+	rv->bytes = sizeof(listing_t) + strlen(path) + 1;
+	return rv;
+}
+
+int listing_add( listing_t *l, const char *name, mode_t mode, int subdir ) {
+	if ( l->count >= l->size ) {
+		int size = l->size ? l->size * 2 : 64;
+		listing_entry_t *entries = realloc(l->entries,size * sizeof(listing_entry_t));
+		if ( !entries )
+			return -1;
+		l->bytes += (size - l->size) * sizeof(listing_entry_t);
+		l->entries = entries;
+		l->size = size;
+	}
+	listing_entry_t *e = &l->entries[l->count];
+	if ( !(e->name = strdup(name)) )
+		return -1;
+	e->mode = mode;
+	e->subdir = subdir;
+	l->bytes += strlen(name) + 1;
+	l->count++;
+	return 0;
+}
+
+static void listing_destroy( listing_t *l ) {
+	for ( int i = 0; i < l->count; i++ )
+		free(l->entries[i].name);
+	free(l->entries);
+	free(l->path);
+	free(l);
+}
+
+// call with lock held
+static void listings_unlink( listings_t *ls, listing_t *l ) {
+	if ( l->newer )
+		l->newer->older = l->older;
+	else
+		ls->newest = l->older;
+	if ( l->older )
+		l->older->newer = l->newer;
+	else
+		ls->oldest = l->newer;
+	l->newer = l->older = NULL;
+}
+
+// call with lock held
+static void listings_link( listings_t *ls, listing_t *l ) {
+	l->older = ls->newest;
+	l->newer = NULL;
+	if ( ls->newest )
+		ls->newest->newer = l;
+	else
+		ls->oldest = l;
+	ls->newest = l;
+}
+
+// drop l from the cache, call with lock held
+static void listings_evict( listings_t *ls, listing_t *l ) {
+	listings_unlink(ls,l);
+	htable_remove(ls->listings,l->path);
+	ls->bytes -= l->bytes;
+	if ( !--l->refs )
+		listing_destroy(l);
+}
+
+listings_t *listings_create( size_t budget ) {
+	listings_t *rv = calloc(1,sizeof(listings_t));
+	rv->listings = htable_create(str_hash,str_equal);
+	rv->budget = budget;
+	pthread_mutex_init(&rv->lock,NULL);
+	return rv;
+}
+
+listing_t *listings_get( listings_t *ls, const char *path ) {
+	struct stat st;
+	int watched = monitor_watching(monitor,path,0); // changes reported by listings_changed()
+	if ( !watched && options.mime_regexp_cnt )
+		return NULL; // files may have changed type unseen
+	if ( !watched && stat(path,&st) )
+		return NULL;
+	pthread_mutex_lock(&ls->lock);
+	listing_t *l = htable_get(ls->listings,path);
+	if ( l && !watched &&
+		 (l->mtime.tv_sec != st.st_mtim.tv_sec || l->mtime.tv_nsec != st.st_mtim.tv_nsec) ) {
+		listings_evict(ls,l); // changed since
+		l = NULL;
+	}
+	if ( l ) {
+		listings_unlink(ls,l);
+		listings_link(ls,l);
+		l->refs++;
+	}
+	pthread_mutex_unlock(&ls->lock);
+	return l;
+}
+
+unsigned long listings_generation( listings_t *ls ) {
+	pthread_mutex_lock(&ls->lock);
+	unsigned long rv = ls->generation;
+	pthread_mutex_unlock(&ls->lock);
+	return rv;
+}
+
+void listings_put( listings_t *ls, listing_t *l, unsigned long generation ) {
+	pthread_mutex_lock(&ls->lock);
+	if ( generation == ls->generation && l->bytes <= ls->budget ) { // else may have missed a change
+		listing_t *old = htable_get(ls->listings,l->path);
+		if ( old )
+			listings_evict(ls,old);
+		htable_put(ls->listings,l->path,l);
+		listings_link(ls,l);
+		l->refs++;
+		ls->bytes += l->bytes;
+		while ( ls->bytes > ls->budget )
+			listings_evict(ls,ls->oldest);
+	}
+	pthread_mutex_unlock(&ls->lock);
+}
+
+void listings_release( listings_t *ls, listing_t *l ) {
+	if ( ls )
+		pthread_mutex_lock(&ls->lock);
+	int last = !--l->refs;
+	if ( ls )
+		pthread_mutex_unlock(&ls->lock);
+	if ( last )
+		listing_destroy(l);
+}
+
+void listings_changed( listings_t *ls, const char *path, int below ) {
+	pthread_mutex_lock(&ls->lock);
+	ls->generation++;
+	listing_t *l = htable_get(ls->listings,path);
+	if ( l )
+		listings_evict(ls,l);
+	if ( below ) {
+		size_t len = strlen(path);
+		listing_t *older;
+		for ( l = ls->newest; l; l = older ) {
+			older = l->older;
+			if ( !strncmp(l->path,path,len) && l->path[len] == '/' )
+				listings_evict(ls,l);
+		}
+	}
+	pthread_mutex_unlock(&ls->lock);
+}
+
+void listings_destroy( listings_t *ls ) {
+	while ( ls->oldest )
+		listings_evict(ls,ls->oldest);
+	htable_destroy(ls->listings);
+	pthread_mutex_destroy(&ls->lock);
+	free(ls);
+}
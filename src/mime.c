@@ -0,0 +1,161 @@
+/*
+	Cmdfs2 : mime.c
+
+	In-process mime type matching using libmagic. Magic handles aren't
+	thread safe so a pool of them is shared between FUSE threads. Results
+	are remembered by inode and mtime so unchanged files are only sniffed once.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <pthread.h>
+#include <magic.h>
+
+#define MIME_FLAGS (MAGIC_MIME_TYPE | MAGIC_SYMLINK | MAGIC_NO_CHECK_ASCII) // as file -b -L --mime-type -e ascii
+#define MIME_DECISIONS_MAX 65536 // remembered results, forget them all beyond this
+
+extern options_t options;
+
+typedef struct {
+	dev_t dev;				// key
+	ino_t ino;
+	struct timespec mtime;
+	int match;
+} decision_t;
+
+static unsigned long decision_hash( const void *key ) {
+	const decision_t *d = (const decision_t *)key;
+	return int_hash((const void *)(unsigned long)(d->ino ^ ((unsigned long)d->dev << 32)));
+}
+
+static int decision_equal( const void *a, const void *b ) {
+	const decision_t *da = (const decision_t *)a;
+	const decision_t *db = (const decision_t *)b;
+	return da->ino == db->ino && da->dev == db->dev;
+}
+
+static int decision_free_visitor( const void *key, void *value, void *data ) {
+	free(value);
+	return 0;
+}
+
+mime_t *mime_create( int handles ) {
+	assert(handles > 0);
+	mime_t *rv = calloc(1,sizeof(mime_t));
+	rv->handles = calloc(handles,sizeof(magic_t));
+	rv->size = handles;
+	rv->decisions = htable_create(decision_hash,decision_equal);
+	pthread_mutex_init(&rv->lock,NULL);
+	pthread_cond_init(&rv->available,NULL);
+	return rv;
+}
+
+/*
+ * Take a handle from the pool, opening a new one if there are none free and
+ * the pool isn't yet full, otherwise wait for one to be released
+ */
+static magic_t mime_acquire( mime_t *m ) {
+	magic_t rv = NULL;
+	pthread_mutex_lock(&m->lock);
+	while ( !m->free_count && m->open_count >= m->size )
+		pthread_cond_wait(&m->available,&m->lock);
+	if ( m->free_count ) {
+		rv = m->handles[--m->free_count];
+	}
+	else {
+		m->open_count++; // reserve while loading, unlocked
+		pthread_mutex_unlock(&m->lock);
+		if ( !(rv = magic_open(MIME_FLAGS)) || magic_load(rv,NULL) ) {
+			log_error("Failed to load magic database (%s)",rv ? magic_error(rv) : strerror(errno));
+			if ( rv )
+				magic_close(rv);
+			rv = NULL;
+		}
+		pthread_mutex_lock(&m->lock);
+		if ( !rv ) {
+			m->open_count--;
+			pthread_cond_signal(&m->available);
+		}
+	}
+	pthread_mutex_unlock(&m->lock);
+	return rv;
+}
+
+static void mime_release( mime_t *m, magic_t h ) {
+	pthread_mutex_lock(&m->lock);
+	m->handles[m->free_count++] = h;
+	pthread_cond_signal(&m->available);
+	pthread_mutex_unlock(&m->lock);
+}
+
+/*
+ * Return whether the mime type of file path matches any of the mime-re
+ * expressions
+ */
+int mime_match( mime_t *m, const char *path ) {
+	struct stat st;
+	if ( stat(path,&st) )
+		return 0;
+	decision_t find = { .dev = st.st_dev, .ino = st.st_ino };
+	pthread_mutex_lock(&m->lock);
+	decision_t *d = htable_get(m->decisions,&find);
+	int rv = d && d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec ? d->match : -1;
+	pthread_mutex_unlock(&m->lock);
+	if ( rv >= 0 )
+		return rv;
+
+	magic_t h = mime_acquire(m);
+	if ( !h )
+		return 0;
+	rv = 0;
+	const char *mime = magic_file(h,path);
+	if ( mime ) {
+		for ( int i = 0; !rv && i < options.mime_regexp_cnt; i++) {
+			rv = !regexec(&options.mime_regexps[i],mime,0,NULL,0);
+		}
+	}
+	else
+		log_debug("Unable to determine mime type of %s (%s)",path,magic_error(h));
+	mime_release(m,h);
+
+	pthread_mutex_lock(&m->lock);
+	if ( !(d = htable_get(m->decisions,&find)) ) {
+		if ( m->decisions->count >= MIME_DECISIONS_MAX ) {
+			htable_visit(m->decisions,decision_free_visitor,NULL);
+			htable_destroy(m->decisions);
+			m->decisions = htable_create(decision_hash,decision_equal);
+		}
+		d = malloc(sizeof(decision_t));
+		*d = find;
+		htable_put(m->decisions,d,d);
+	}
+	d->mtime = st.st_mtim;
+	d->match = rv;
+	pthread_mutex_unlock(&m->lock);
+	return rv;
+}
+
+void mime_destroy( mime_t *m ) {
+	for ( int i = 0; i < m->free_count; i++ )
+		magic_close(m->handles[i]);
+	htable_visit(m->decisions,decision_free_visitor,NULL);
+	htable_destroy(m->decisions);
+	pthread_cond_destroy(&m->available);
+	pthread_mutex_destroy(&m->lock);
+	free(m->handles);
+	free(m);
+}
@@ -22,105 +22,617 @@
 #include "cmdfs.h"
 #include <pthread.h>
 #include <sys/inotify.h>
+#include <sys/fanotify.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
-int wd_t_compare( const void *_a, const void *_b) {
-	const wd_t *a = (const wd_t *)_a;
-	const wd_t *b = (const wd_t *)_b;
-	return a->wd < b->wd ? -1 : a->wd > b->wd ? 1 : 0;
-}
-static int monitor_add_directory_visitor( const dir_info *visit, void *data ) {
-	if ( S_ISDIR(visit->mode) && strcmp(visit->name,".") && strcmp(visit->name,"..")) {
-		monitor_t *m = (monitor_t *)data;
-		int wd = inotify_add_watch(m->fd,visit->path,IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM);
-		if ( wd > 0 || errno == ENOSPC ) {
-			log_debug(wd>0?"Added watch for %s":"Pending adding watch for when inotify resource available %s",visit->path);//
-			if ( m->wd_lut_count >= m->wd_lut_size) {
-				m->wd_lut_size *= 2; // need more space in buffer - double it
-				m->wd_lut = realloc(m->wd_lut,m->wd_lut_size*sizeof(wd_t));
-				if ( !m->wd_lut )
-					return -1; // error allocating
-			}
-			m->wd_lut[m->wd_lut_count].wd = wd;
-			m->wd_lut[m->wd_lut_count++].path = strdup(visit->path);
-			qsort(m->wd_lut,m->wd_lut_count,sizeof(wd_t),wd_t_compare); // keep wd list sorted
+extern options_t options;
+extern dircount_t *dircount;
+extern listings_t *listings;
+extern inodes_t *inodes;
+extern scheduler_t *scheduler;
+extern index_t *cache_index;
+extern plugin_t *plugin;
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM)
+#define PREFETCH_BATCH 16 // settled files cached per transform worker job
+
+// a source directory without a watch
+typedef struct {
+	char *path;			// key
+	int tree;			// failed, nothing below is watched either. Else waiting for inotify resource
+} unwatched_t;
+
+// one copy of each directory name, shared by every watch with that name
+static const char *monitor_intern( monitor_t *m, const char *name ) {
+	const char *rv = htable_get(m->names,name);
+	if ( !rv ) {
+		rv = strdup(name);
+		htable_put(m->names,rv,(void *)rv);
+	}
+	return rv;
+}
+
+/*
+ * Write the full path of w to buf, returns its length
+ */
+static int watch_path( const watch_t *w, char *buf, size_t size ) {
+	int len = w->parent ? watch_path(w->parent,buf,size) : 0;
+	return len + snprintf(buf+len,size > len ? size-len : 0,w->parent ? "/%s" : "%s",w->name);
+}
+
+static watch_t *watch_child( monitor_t *m, watch_t *w, const char *name ) {
+	const char *interned = htable_get(m->names,name); // not known, can't be watched
+	watch_t *child = interned ? w->children : NULL;
+	while ( child && child->name != interned )
+		child = child->sibling;
+	return child;
+}
+
+// record directory path as unwatched, or with watched as now watched
+static void monitor_unwatched( monitor_t *m, const char *path, int watched, int tree ) {
+	pthread_mutex_lock(&m->lock);
+	unwatched_t *u = htable_get(m->unwatched,path);
+	if ( watched && u ) {
+		htable_remove(m->unwatched,path);
+		free(u->path);
+		free(u);
+	}
+	else if ( !watched ) {
+		if ( !u ) {
+			u = malloc(sizeof(unwatched_t));
+			u->path = strdup(path);
+			htable_put(m->unwatched,u->path,u);
 		}
-		else {
-			log_debug("Failed adding watch for directory %s",visit->path);
-			return -1; // unrecoverable error registering
+		u->tree = tree;
+	}
+	pthread_mutex_unlock(&m->lock);
+}
+
+/*
+ * Note the monitor has stopped, nothing is reported from now on. The kernel
+ * may have been told to keep what it knows for long, expecting to hear
+ */
+static void monitor_failed( monitor_t *m, int status ) {
+	pthread_mutex_lock(&m->lock);
+	m->status = status;
+	pthread_mutex_unlock(&m->lock);
+	if ( inodes )
+		inodes_invalidate(inodes);
+}
+
+static int monitor_add_watch( monitor_t *m, watch_t *w, const char *path ) {
+	w->wd = inotify_add_watch(m->fd,path,WATCH_MASK);
+	if ( w->wd > 0 ) {
+		htable_put(m->watches,(void *)(long)w->wd,w);
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Watch directory path, named name in parent (NULL for the root), and
+ * all its subdirectories unless lazy. Returns the new watch, or NULL if it
+ * couldn't be added
+ */
+static watch_t *monitor_add_directory( monitor_t *m, watch_t *parent, const char *name, const char *path ) {
+	watch_t *w = calloc(1,sizeof(watch_t));
+	w->name = monitor_intern(m,name);
+	if ( !monitor_add_watch(m,w,path) ) {
+		log_debug("Added watch for %s",path);
+		monitor_unwatched(m,path,1,0);
+	}
+	else if ( errno == ENOSPC ) {
+		log_debug("Pending adding watch for when inotify resource available %s",path);
+		w->wd = -1;
+		w->pending = m->pending;
+		m->pending = w;
+		monitor_unwatched(m,path,0,0);
+	}
+	else {
+		log_debug("Failed adding watch for directory %s (%s)",path,strerror(errno));
+		monitor_unwatched(m,path,0,1);
+		free(w);
+		return NULL;
+	}
+	w->parent = parent;
+	w->used = time(NULL);
+	if ( parent ) {
+		w->sibling = parent->children;
+		parent->children = w;
+	}
+
+	struct stat st;
+	DIR *dirp = NULL;
+	if ( m->lazy ) {
+		if ( !stat(path,&st) )
+			w->mtime = st.st_mtim; // subdirectories are watched when accessed
+	}
+	else if ( (dirp = opendir(path)) ) {
+		if ( !fstat(dirfd(dirp),&st) )
+			w->mtime = st.st_mtim; // as listed, for monitor_resync()
+		struct dirent *dp;
+		while ( (dp = readdir(dirp)) != NULL ) {
+			if ( !strcmp(dp->d_name,".") || !strcmp(dp->d_name,"..") )
+				continue;
+			char subdir[strlen(path)+strlen(dp->d_name)+2];
+			sprintf(subdir,"%s/%s",path,dp->d_name);
+			if ( S_ISDIR(quick_stat(subdir,dp)) )
+				monitor_add_directory(m,w,dp->d_name,subdir);
 		}
+		closedir(dirp);
+	}
+	return w;
+}
+
+// remove w and its descendants, returns the number of watches released
+static int monitor_remove_watches( monitor_t *m, watch_t *w ) {
+	int released = 0;
+	while ( w->children ) {
+		watch_t *child = w->children;
+		w->children = child->sibling;
+		released += monitor_remove_watches(m,child);
+	}
+	if ( w->wd > 0 ) {
+		// fails if the kernel dropped it with the directory, released either way
+		inotify_rm_watch(m->fd,w->wd);
+		htable_remove(m->watches,(void *)(long)w->wd);
+		released++;
 	}
+	else {
+		watch_t **p = &m->pending;
+		while ( *p && *p != w )
+			p = &(*p)->pending;
+		if ( *p )
+			*p = w->pending;
+		char path[PATH_MAX];
+		watch_path(w,path,sizeof(path));
+		monitor_unwatched(m,path,1,0); // gone, nothing to report
+	}
+	free(w);
+	return released;
+}
+
+static void monitor_remove_directory( monitor_t *m, watch_t *w ) {
+	if ( w->parent ) {
+		watch_t **p = &w->parent->children;
+		while ( *p != w )
+			p = &(*p)->sibling;
+		*p = w->sibling;
+	}
+	int watches_released = monitor_remove_watches(m,w);
+
+	/**
+	* For every released watch we can add a new one if the request previously
+	* wasn't granted due to the inotify limit.
+	*/
+	while ( watches_released > 0 && m->pending ) {
+		watch_t *pending = m->pending;
+		char path[PATH_MAX];
+		watch_path(pending,path,sizeof(path));
+		if ( monitor_add_watch(m,pending,path) ) {
+			pending->wd = -1;
+			break;
+		}
+		m->pending = pending->pending;
+		pending->pending = NULL;
+		watches_released--;
+		monitor_unwatched(m,path,1,0);
+		log_debug("Added watch for pending %s",path);
+	}
+}
+
+static long monitor_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Cache each file in the NULL terminated list of source paths, then free it.
+ * Runs on a transform worker.
+ */
+static int monitor_prefetch( void *_batch ) {
+	char **batch = (char **)_batch;
+	int uncached = plugin && plugin_maps(plugin); // read straight from the source
+	for ( char **path = batch; *path; path++ ) {
+		struct stat st;
+		vfile_t *f = file_create_from_src(*path);
+		if ( !uncached && !stat(*path,&st) && S_ISREG(st.st_mode) && file_get_command(f) && file_encache(f) )
+			log_debug("New file %s cached",*path);
+		file_destroy(f);
+		free(*path);
+	}
+	free(batch);
 	return 0;
 }
 
-void monitor_add_directory( monitor_t *m, const char *path ) {
-	dir_visit(path,-1,monitor_add_directory_visitor,m);
-}
-void monitor_remove_directory( monitor_t *m, char *name ) {
-	// remove all records with leading path as one found
-	const char *root = strdup(name);
-	wd_t *src = m->wd_lut;
-	wd_t *dst = m->wd_lut;
-	int new_count = 0;
-	int watches_released = 0;
-	while (src < m->wd_lut + m->wd_lut_count) {
-		if ( strncmp(src->path,root,strlen(root)) ) {
-			if ( dst != src )
-				*dst++ = *src; // copy
-			else
-				dst++;
-			new_count++;
+// (re)start the quiet period of source file path
+static void monitor_settle( monitor_t *m, const char *path ) {
+	settle_t *s = htable_get(m->settling,path);
+	if ( s ) {
+		*(s->prev ? &s->prev->next : &m->settle_head) = s->next;
+		*(s->next ? &s->next->prev : &m->settle_tail) = s->prev;
+	}
+	else {
+		s = calloc(1,sizeof(settle_t));
+		s->path = strdup(path);
+		htable_put(m->settling,s->path,s);
+	}
+	s->due = monitor_now() + m->settle_ms;
+	s->next = NULL;
+	s->prev = m->settle_tail;
+	*(m->settle_tail ? &m->settle_tail->next : &m->settle_head) = s;
+	m->settle_tail = s;
+}
+
+// forget path if settling, returning it to be freed
+static settle_t *monitor_unsettle( monitor_t *m, const char *path ) {
+	settle_t *s = htable_remove(m->settling,path);
+	if ( s ) {
+		*(s->prev ? &s->prev->next : &m->settle_head) = s->next;
+		*(s->next ? &s->next->prev : &m->settle_tail) = s->prev;
+	}
+	return s;
+}
+
+/*
+ * Hand files that have settled to the transform workers, in batches. Returns
+ * ms until the next will have settled, or -1 if none are waiting
+ */
+static int monitor_flush( monitor_t *m ) {
+	long now = monitor_now();
+	while ( m->settle_head && m->settle_head->due <= now ) {
+		char **batch = calloc(PREFETCH_BATCH+1,sizeof(char *));
+		for ( int i = 0; i < PREFETCH_BATCH && m->settle_head && m->settle_head->due <= now; i++ ) {
+			settle_t *s = monitor_unsettle(m,m->settle_head->path);
+			batch[i] = s->path; // passed on to the batch
+			free(s);
 		}
-		else {
-			if (src->wd >0) {
-				if  (inotify_rm_watch(m->fd,src->wd)) {
-					watches_released++;
-				}
-				else {
-					log_warning("Unable to remove watch for %s",src->path);
-				}
+		if ( scheduler )
+			scheduler_submit(scheduler,monitor_prefetch,batch);
+		else
+			monitor_prefetch(batch);
+	}
+	return m->settle_head ? m->settle_head->due - now : -1;
+}
+
+/*
+ * Note that source directory path has been accessed through the mount. In lazy
+ * mode this is what gets directories watched. Called from FUSE threads.
+ */
+void monitor_access( monitor_t *m, const char *path ) {
+	if ( !m->lazy )
+		return;
+	pthread_mutex_lock(&m->lock);
+	int wake = !m->accessed->count;
+	if ( !htable_get(m->accessed,path) ) {
+		char *key = strdup(path);
+		htable_put(m->accessed,key,key);
+	}
+	pthread_mutex_unlock(&m->lock);
+	if ( wake ) {
+		uint64_t one = 1;
+		if ( write(m->wake_fd,&one,sizeof(one)) < 0 )
+			log_warning("Waking monitor (%s)",strerror(errno));
+	}
+}
+
+// watch path and the directories leading to it, and note them as used
+static int monitor_use_visitor( const void *key, void *value, void *data ) {
+	monitor_t *m = (monitor_t *)data;
+	const char *path = (const char *)value;
+	size_t rootlen = strlen(m->rootdir);
+	time_t now = time(NULL);
+	watch_t *w = m->root;
+	if ( w && !strncmp(path,m->rootdir,rootlen) && (!path[rootlen] || path[rootlen] == '/') ) {
+		w->used = now;
+		char sub[strlen(path)+1];
+		const char *name = path+rootlen;
+		while ( w && *name++ == '/' ) {
+			const char *end = strchrnul(name,'/');
+			char component[end-name+1];
+			snprintf(component,sizeof(component),"%s",name);
+			snprintf(sub,end-path+1,"%s",path);
+			watch_t *child = watch_child(m,w,component);
+			if ( !child && (child = monitor_add_directory(m,w,component,sub)) )
+				log_debug("Accessed directory %s watched",sub);
+			if ( (w = child) )
+				w->used = now;
+			name = end;
+		}
+	}
+	free(value);
+	return 0;
+}
+
+// drop watches of directories not used since before, and have none below them
+static int monitor_evict( monitor_t *m, watch_t *w, time_t before ) {
+	int leaf = 1;
+	watch_t *next;
+	for ( watch_t *child = w->children; child; child = next ) {
+		next = child->sibling;
+		leaf &= monitor_evict(m,child,before);
+	}
+	if ( leaf && w != m->root && w->used < before ) {
+		char path[PATH_MAX];
+		watch_path(w,path,sizeof(path));
+		log_debug("Idle directory %s no longer watched",path);
+		monitor_remove_directory(m,w);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Watch directories accessed since last called, and in time stop watching
+ * those left idle. Returns ms until eviction is next due
+ */
+static int monitor_lazy( monitor_t *m ) {
+	pthread_mutex_lock(&m->lock);
+	htable_t *accessed = m->accessed;
+	m->accessed = htable_create(str_hash,str_equal);
+	pthread_mutex_unlock(&m->lock);
+	htable_visit(accessed,monitor_use_visitor,m);
+	htable_destroy(accessed);
+	long now = monitor_now();
+	long period = m->idle * 1000 / 4; // so idle watches go within 1.25*idle
+	if ( now >= m->evict_due ) {
+		if ( m->root )
+			monitor_evict(m,m->root,time(NULL) - m->idle);
+		m->evict_due = now + (period > 1000 ? period : 1000);
+	}
+	return m->evict_due - now;
+}
+
+/*
+ * Wait for events on m->fd, meanwhile passing on files as they settle and
+ * watching directories as they are accessed. Returns as poll()
+ */
+static int monitor_wait( monitor_t *m ) {
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,NULL);
+		int timeout = monitor_flush(m);
+		if ( m->lazy ) {
+			int due = monitor_lazy(m);
+			if ( timeout < 0 || due < timeout )
+				timeout = due;
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE,NULL);
+		struct pollfd pfd[2] = { { .fd = m->fd, .events = POLLIN }, { .fd = m->wake_fd, .events = POLLIN } };
+		int r = poll(pfd,m->wake_fd >= 0 ? 2 : 1,timeout);
+		if ( r > 0 && (pfd[1].revents & POLLIN) ) {
+			uint64_t count;
+			if ( read(m->wake_fd,&count,sizeof(count)) < 0 && errno != EAGAIN )
+				log_warning("Reading monitor wakeups (%s)",strerror(errno));
+			r -= 1;
+		}
+		if ( r )
+			return r;
+	}
+}
+
+/*
+ * Name, in source directory dir, is being written. It hasn't settled until
+ * the writes stop, nothing else need be done until it's closed
+ */
+static void monitor_modified( monitor_t *m, const char *dir, const char *name ) {
+	char path[strlen(dir)+strlen(name)+2];
+	sprintf(path,"%s/%s",dir,name);
+	monitor_settle(m,path);
+}
+
+/*
+ * Act on name, in source directory dir, having been created or written
+ * (created != 0) or deleted/moved away
+ */
+static void monitor_event( monitor_t *m, watch_t *w, const char *dir, const char *name, int created, int isdir ) {
+	char path[strlen(dir)+strlen(name)+2];
+	sprintf(path,"%s/%s",dir,name);
+	if ( dircount )
+		dircount_changed(dircount,dir); // recount when next asked
+	if ( listings ) {
+		listings_changed(listings,dir,0); // list again when next asked
+		if ( isdir )
+			listings_changed(listings,path,1); // replaced, or moved with all below
+	}
+	if ( inodes )
+		inodes_changed(inodes,path+strlen(m->rootdir),options.hide_empty_dirs); // the kernel looks it up again
+	if ( created ) {
+		struct stat st;
+		if ( !stat(path,&st) ) {
+			if ( S_ISREG(st.st_mode)) {
+				// Is a new file - cache it once it stops changing
+				monitor_settle(m,path);
+			}
+			else if ( S_ISDIR(st.st_mode) && w && !m->lazy && !watch_child(m,w,name) ) {
+				// is a new directory - watch it, and any subdirs
+				monitor_add_directory(m,w,name,path);
+				log_debug("New directory %s watched",path);
 			}
-			free(src->path); // destroy
 		}
-		src++;
 	}
-	free((void *)root);
-	m->wd_lut_count = new_count;
+	else if ( !isdir ) {
+		// clean any cached file
+		settle_t *s = monitor_unsettle(m,path);
+		if ( s ) {
+			free(s->path);
+			free(s);
+		}
+		vfile_t *f = file_create_from_src(path);
+		file_decache(f);
+		file_destroy(f);
+		log_debug("File %s decached",path);
+	}
+	else if ( w && (w = watch_child(m,w,name)) ) {
+		// directory
+		monitor_remove_directory(m,w);
+		log_debug("Directory %s removed",path);
+	}
+}
 
-	/**
-	* For every released watch we can add a new one if the request previously
-	* wasn't granted due to the inotify limit. These were marked by having a wd=-1 in the list
-	*/
-	wd_t find = { .wd = -1 };
-	wd_t *wd_found = m->wd_lut;
-	while ( watches_released > 0) {
-			wd_found = bsearch(&find,wd_found,m->wd_lut_count-(wd_found-m->wd_lut),sizeof(wd_t),wd_t_compare);
-			if ( wd_found ) {
-				wd_found->wd = inotify_add_watch(m->fd,wd_found->path,IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM);
-				if ( wd_found->wd ) {
-					watches_released--;
-					log_debug("Added watch for pending %s",wd_found->path);//
+/*
+ * Catch up with changes to directory path, and below, that events may have
+ * been lost for. w is its watch, or NULL if there are none (fanotify), in which
+ * case everything is rescanned. Otherwise directories are only rescanned if
+ * listing them again would give something different, as their mtime shows, or
+ * all is set. Directories rescanned are added to changed.
+ */
+static void monitor_resync( monitor_t *m, watch_t *w, const char *path, int all, htable_t *changed ) {
+	struct stat st;
+	if ( stat(path,&st) || !S_ISDIR(st.st_mode) )
+		return;
+	watch_t *known = w ? w->children : NULL; // children added below go in front of these
+	if ( all || !w || w->mtime.tv_sec != st.st_mtim.tv_sec || w->mtime.tv_nsec != st.st_mtim.tv_nsec ) {
+		DIR *dirp = opendir(path);
+		if ( !dirp )
+			return;
+		if ( w )
+			w->mtime = st.st_mtim;
+		const char *dir = path+strlen(m->rootdir);
+		if ( !htable_get(changed,dir) ) {
+			char *key = strdup(dir);
+			htable_put(changed,key,key);
+		}
+		if ( dircount )
+			dircount_changed(dircount,path);
+		if ( listings )
+			listings_changed(listings,path,0);
+		if ( inodes )
+			inodes_changed(inodes,dir,options.hide_empty_dirs);
+		struct dirent *dp;
+		while ( (dp = readdir(dirp)) != NULL ) {
+			if ( !strcmp(dp->d_name,".") || !strcmp(dp->d_name,"..") )
+				continue;
+			char sub[strlen(path)+strlen(dp->d_name)+2];
+			sprintf(sub,"%s/%s",path,dp->d_name);
+			int mode = quick_stat(sub,dp);
+			if ( S_ISREG(mode) ) {
+				off_t size;
+				// up to date if the index has it as generated from the source as it is
+				if ( !cache_index || stat(sub,&st) || !index_lookup(cache_index,sub+strlen(m->rootdir),&st,&size) ) {
+					monitor_settle(m,sub);
+					if ( inodes )
+						inodes_changed(inodes,sub+strlen(m->rootdir),0);
 				}
 			}
-			else {
-				break; // no more needed
+			else if ( S_ISDIR(mode) ) {
+				if ( !w )
+					monitor_resync(m,NULL,sub,1,changed);
+				else if ( !m->lazy && !watch_child(m,w,dp->d_name) )
+					monitor_add_directory(m,w,dp->d_name,sub);
 			}
+		}
+		closedir(dirp);
 	}
+	if ( w ) {
+		watch_t *next;
+		int added = 1;
+		for ( watch_t *child = w->children; child; child = next ) {
+			next = child->sibling;
+			if ( child == known )
+				added = 0; // past those just added, whose contents are all new
+			char sub[strlen(path)+strlen(child->name)+2];
+			sprintf(sub,"%s/%s",path,child->name);
+			if ( stat(sub,&st) || !S_ISDIR(st.st_mode) )
+				monitor_remove_directory(m,child); // gone
+			else
+				monitor_resync(m,child,sub,all || added,changed);
+		}
+	}
+}
 
+static int monitor_free_name( const void *key, void *value, void *data ) {
+	free(value);
+	return 0;
 }
 
-void *monitor_run( void *_monitor ) {
-	log_debug("monitor run");
-	monitor_t *m = (monitor_t *)_monitor;
+static int monitor_free_unwatched( const void *key, void *value, void *data ) {
+	unwatched_t *u = (unwatched_t *)value;
+	free(u->path);
+	free(u);
+	return 0;
+}
+
+// whether path is key, or below it
+static int path_within( const char *path, const char *key ) {
+	size_t len = strlen(key);
+	return !strncmp(path,key,len) && (!path[len] || path[len] == '/');
+}
+
+// is data a directory below the unwatched one
+static int monitor_unwatched_below( const void *key, void *value, void *data ) {
+	const char *path = (const char *)data;
+	return path_within((const char *)key,path) && strcmp((const char *)key,path);
+}
+
+int monitor_watching( monitor_t *m, const char *path, int below ) {
+	if ( !m )
+		return 0;
+	pthread_mutex_lock(&m->lock);
+	int rv = m->ready && !m->status && !m->lazy && path_within(path,m->rootdir);
+	if ( rv && m->unwatched->count ) {
+		// it, or a directory above whose subdirectories weren't watched
+		rv = !htable_get(m->unwatched,path);
+		char p[strlen(path)+1];
+		strcpy(p,path);
+		for ( char *slash; rv && (slash = strrchr(p,'/')) && slash > p; ) {
+			*slash = '\0';
+			unwatched_t *u = htable_get(m->unwatched,p);
+			rv = !u || !u->tree;
+		}
+		if ( rv && below )
+			rv = !htable_visit(m->unwatched,monitor_unwatched_below,(void *)path);
+	}
+	pthread_mutex_unlock(&m->lock);
+	return rv;
+}
+
+/*
+ * Events have been lost, bring the cache back into line with the source tree
+ */
+static void monitor_overflowed( monitor_t *m ) {
+	log_warning("Monitor events lost, resynchronising %s",m->rootdir);
+	htable_t *changed = htable_create(str_hash,str_equal);
+	monitor_resync(m,m->root,m->rootdir,0,changed);
+	if ( cache_index ) {
+		// cached files for sources no longer there
+		char **paths = index_paths_in(cache_index,changed);
+		for ( char **path = paths; *path; path++ ) {
+			char src[strlen(m->rootdir)+strlen(*path)+1];
+			sprintf(src,"%s%s",m->rootdir,*path);
+			struct stat st;
+			if ( stat(src,&st) && errno == ENOENT ) {
+				vfile_t *f = file_create_from_src(src);
+				file_decache(f);
+				file_destroy(f);
+				log_debug("File %s decached",src);
+			}
+			free(*path);
+		}
+		free(paths);
+	}
+	log_debug("Resynchronised %lu directories",changed->count);
+	htable_visit(changed,monitor_free_name,NULL);
+	htable_destroy(changed);
+}
+
+static void monitor_run_inotify( monitor_t *m ) {
 	if ( (m->fd = inotify_init()) != -1) {
-		monitor_add_directory(m,m->rootdir);
+		m->root = monitor_add_directory(m,NULL,m->rootdir,m->rootdir);
+		pthread_mutex_lock(&m->lock);
+		m->ready = 1; // changes from here on are reported, for directories watched
+		pthread_mutex_unlock(&m->lock);
 		int bufsize = 1024 * sizeof(struct inotify_event);
 		char *eventbuf = malloc(bufsize);
 
 		for (;;) {
-			int r = read(m->fd,eventbuf,bufsize);
+			int r = monitor_wait(m) < 0 ? -1 : read(m->fd,eventbuf,bufsize);
 			if ( r == 0 || (r < 0 && errno == EINVAL) ) {
 				bufsize *= 2;
 				eventbuf = realloc(eventbuf,bufsize);
@@ -129,58 +641,32 @@ void *monitor_run( void *_monitor ) {
 				if ( errno == EINTR )
 					continue; // debugger
 				log_error("Read failed from inotify: %s\n",strerror(errno));
-				m->status = errno;
+				monitor_failed(m,errno);
 				break;
 			}
 			else {
+				pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,NULL); // leave the watch tree whole for monitor_destroy()
 				char *eptr = eventbuf;
+				int overflowed = 0;
 				while ( eptr < eventbuf+r) {
 					struct inotify_event *event = (struct inotify_event *)eptr;
-					wd_t find = { .wd = event->wd };
-					wd_t *wd_found = bsearch(&find,m->wd_lut,m->wd_lut_count,sizeof(wd_t),wd_t_compare);
-					if ( wd_found && event->name && event->len > 0) {
-						char name[strlen(wd_found->path) + event->len+2];
-						sprintf(name,"%s/",wd_found->path);
-						strncat(name, event->name, event->len);
-						if ( event->mask & (IN_MOVED_TO | IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE )) {
-							struct stat st;
-							if ( !stat(name,&st) ) {
-								if ( S_ISREG(st.st_mode)) {
-									// Is a new file - stat the corresponding file in the fuse namespace to encache
-									// if needed
-									char dst[strlen(m->mountdir)+strlen(name)+2];
-									sprintf(dst,name[0] == '/'?"%s%s":"%s/%s",m->mountdir,name+strlen(m->rootdir));
-									if (stat(dst,&st))
-										log_warning("Monitor failed to stat %s\n",dst);
-									else
-										log_debug("New file %s cached",dst);
-
-								}
-								else if ( S_ISDIR(st.st_mode)) {
-									// is a new directory - watch it, and any subdirs
-									monitor_add_directory(m,name);
-									log_debug("New directory %s watched",name);
-								}
-							}
-
-						}
-						else if ( event->mask & (IN_DELETE | IN_MOVED_FROM) ) {
-							if ( !(event->mask & IN_ISDIR) ) {
-								// clean any cached file
-								vfile_t *f = file_create_from_src(name);
-								file_decache(f);
-								file_destroy(f);
-								log_debug("File %s decached",name);
-							}
-							else {
-								// directory
-								monitor_remove_directory(m,name);
-								log_debug("Directory %s removed",name);
-							}
-						}
+					overflowed |= event->mask & IN_Q_OVERFLOW;
+					watch_t *w = htable_get(m->watches,(void *)(long)event->wd);
+					if ( w && event->len > 0) {
+						char dir[PATH_MAX];
+						watch_path(w,dir,sizeof(dir));
+						if ( event->mask & (IN_MOVED_TO | IN_CREATE | IN_CLOSE_WRITE ))
+							monitor_event(m,w,dir,event->name,1,event->mask & IN_ISDIR);
+						else if ( event->mask & (IN_DELETE | IN_MOVED_FROM) )
+							monitor_event(m,w,dir,event->name,0,event->mask & IN_ISDIR);
+						else if ( (event->mask & (IN_MODIFY | IN_ISDIR)) == IN_MODIFY )
+							monitor_modified(m,dir,event->name);
 					}
 					eptr += sizeof(struct inotify_event) + event->len;
 				}
+				if ( overflowed )
+					monitor_overflowed(m);
+				pthread_setcancelstate(PTHREAD_CANCEL_ENABLE,NULL);
 			}
 		}
 		free(eventbuf);
@@ -188,20 +674,123 @@ void *monitor_run( void *_monitor ) {
 	}
 	else {
 		log_error("Failed to initialize inotify: %s\n",strerror(errno));
-		m->status = errno;
+		monitor_failed(m,errno);
+	}
+}
+
+/*
+ * Watch the whole source tree with one fanotify mark on its filesystem. Events
+ * identify the directory by handle and the entry by name, so nothing need be
+ * registered per directory. Returns -1 if fanotify can't be used here (it needs
+ * Linux 5.9 and CAP_SYS_ADMIN), before any events are consumed.
+ */
+static int monitor_run_fanotify( monitor_t *m ) {
+#ifdef FAN_REPORT_DFID_NAME
+	int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME,O_RDONLY | O_CLOEXEC);
+	if ( fd < 0 ) {
+		log_debug("fanotify unavailable, using inotify (%s)",strerror(errno));
+		return -1;
+	}
+	int mount_fd = open(m->rootdir,O_RDONLY | O_DIRECTORY | O_CLOEXEC); // for open_by_handle_at()
+	if ( mount_fd < 0 ||
+		 fanotify_mark(fd,FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MODIFY | FAN_CLOSE_WRITE | FAN_ONDIR,AT_FDCWD,m->rootdir) ) {
+		log_debug("fanotify mark failed, using inotify (%s)",strerror(errno));
+		if ( mount_fd >= 0 )
+			close(mount_fd);
+		close(fd);
+		return -1;
+	}
+	m->fd = fd;
+	m->fanotify = 1;
+	pthread_mutex_lock(&m->lock);
+	m->lazy = 0; // nothing to register
+	m->ready = 1;
+	pthread_mutex_unlock(&m->lock);
+	log_debug("Watching %s with fanotify",m->rootdir);
+	size_t rootlen = strlen(m->rootdir);
+	char eventbuf[65536] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+	for (;;) {
+		ssize_t r = monitor_wait(m) < 0 ? -1 : read(fd,eventbuf,sizeof(eventbuf));
+		if ( r < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			log_error("Read failed from fanotify: %s\n",strerror(errno));
+			monitor_failed(m,errno);
+			break;
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,NULL);
+		int overflowed = 0;
+		struct fanotify_event_metadata *event = (struct fanotify_event_metadata *)eventbuf;
+		for ( ; FAN_EVENT_OK(event,r); event = FAN_EVENT_NEXT(event,r) ) {
+			if ( event->mask & FAN_Q_OVERFLOW ) {
+				overflowed = 1;
+				continue;
+			}
+			struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)(event+1);
+			if ( event->event_len <= event->metadata_len || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME )
+				continue;
+			struct file_handle *handle = (struct file_handle *)fid->handle;
+			const char *name = (const char *)(handle->f_handle + handle->handle_bytes);
+			int dfd = open_by_handle_at(mount_fd,handle,O_PATH | O_CLOEXEC);
+			if ( dfd < 0 )
+				continue; // directory gone since
+			char proc[32];
+			char dir[PATH_MAX];
+			sprintf(proc,"/proc/self/fd/%d",dfd);
+			ssize_t len = readlink(proc,dir,sizeof(dir)-1);
+			close(dfd);
+			if ( len < 0 )
+				continue;
+			dir[len] = '\0';
+			// the mark covers the whole filesystem, only the source tree is of interest
+			if ( strncmp(dir,m->rootdir,rootlen) || (dir[rootlen] && dir[rootlen] != '/') )
+				continue;
+			// merged events are taken as the most significant
+			if ( event->mask & (FAN_CREATE | FAN_MOVED_TO | FAN_CLOSE_WRITE) )
+				monitor_event(m,NULL,dir,name,1,event->mask & FAN_ONDIR);
+			else if ( event->mask & (FAN_DELETE | FAN_MOVED_FROM) )
+				monitor_event(m,NULL,dir,name,0,event->mask & FAN_ONDIR);
+			else if ( (event->mask & (FAN_MODIFY | FAN_ONDIR)) == FAN_MODIFY )
+				monitor_modified(m,dir,name);
+		}
+		if ( overflowed )
+			monitor_overflowed(m); // no directory snapshots, so rescans the whole tree
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE,NULL);
 	}
+	close(mount_fd);
+	close(fd);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void *monitor_run( void *_monitor ) {
+	log_debug("monitor run");
+	monitor_t *m = (monitor_t *)_monitor;
+	if ( !options.fanotify || monitor_run_fanotify(m) )
+		monitor_run_inotify(m);
 	return (void *)m;
 
 
 }
 
-monitor_t *monitor_create( const char *rootdir, const char *mountdir ) {
+monitor_t *monitor_create( const char *rootdir, const char *mountdir, long settle ) {
 
 	monitor_t *rv = calloc(1,sizeof(monitor_t));
 	rv->rootdir = strdup(rootdir);
 	rv->mountdir = strdup(mountdir);
-	rv->wd_lut_size = 1024;
-	rv->wd_lut = malloc(rv->wd_lut_size * sizeof(wd_t));
+	rv->watches = htable_create(int_hash,int_equal);
+	rv->names = htable_create(str_hash,str_equal);
+	rv->settling = htable_create(str_hash,str_equal);
+	rv->settle_ms = settle * 1000;
+	rv->lazy = options.monitor_lazy;
+	rv->idle = options.monitor_idle;
+	rv->accessed = htable_create(str_hash,str_equal);
+	rv->unwatched = htable_create(str_hash,str_equal);
+	rv->wake_fd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+	pthread_mutex_init(&rv->lock,NULL);
 
 	pthread_create(&rv->thread,NULL,monitor_run,rv);
 	return rv;
@@ -210,23 +799,33 @@ monitor_t *monitor_create( const char *rootdir, const char *mountdir ) {
 void monitor_destroy(monitor_t *m) {
 	void *retval;
 
-	for ( wd_t *wd_p = m->wd_lut; wd_p < m->wd_lut+m->wd_lut_count; wd_p++) {
-		if  (wd_p->wd > 0 && !inotify_rm_watch(m->fd,wd_p->wd)) {
-			log_debug("Removed watch %s",wd_p->path);
-		}
-		free(wd_p->path);
-	}
 	m->stop = 1;
 	if ( m->thread ) {
 		pthread_cancel(m->thread);
 		pthread_join(m->thread,&retval);
 	}
-	log_debug("Monitor exit with status: %s", m->status);
+	if ( m->root )
+		monitor_remove_watches(m,m->root);
+	log_debug("Monitor exit with status: %s", m->status ? strerror(m->status) : "ok");
 	if ( m->rootdir)
 		free((void *)m->rootdir);
 	if ( m->mountdir)
 		free((void *)m->mountdir);
-	if ( m->wd_lut )
-		free( m->wd_lut );
+	while ( m->settle_head ) {
+		settle_t *s = monitor_unsettle(m,m->settle_head->path);
+		free(s->path);
+		free(s);
+	}
+	htable_destroy(m->settling);
+	htable_visit(m->accessed,monitor_free_name,NULL);
+	htable_destroy(m->accessed);
+	htable_visit(m->unwatched,monitor_free_unwatched,NULL);
+	htable_destroy(m->unwatched);
+	pthread_mutex_destroy(&m->lock);
+	if ( m->wake_fd >= 0 )
+		close(m->wake_fd);
+	htable_destroy(m->watches);
+	htable_visit(m->names,monitor_free_name,NULL);
+	htable_destroy(m->names);
 	free(m);
 }
@@ -0,0 +1,113 @@
+/*
+	Cmdfs2 : plugin.c
+
+	In-process transforms. A plugin named with the plugin option is loaded
+	when mounting and called on the transform workers in place of a command,
+	with its output going to the cache file as a command's would. Plugins
+	providing a map function are applied as files are read instead, straight
+	from the source. See cmdfs_plugin.h.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <dlfcn.h>
+#include <fcntl.h>
+
+/*
+ * Load the plugin at path and set it up with opts. Returns NULL if it can't
+ * be loaded or isn't a plugin for this version of cmdfs.
+ */
+plugin_t *plugin_create( const char *path, const char *opts ) {
+	void *handle = dlopen(path,RTLD_NOW | RTLD_LOCAL);
+	if ( !handle ) {
+		log_error("Loading plugin %s (%s)",path,dlerror());
+		return NULL;
+	}
+	const cmdfs_plugin_t *api = dlsym(handle,CMDFS_PLUGIN_SYMBOL);
+	if ( !api ) {
+		log_error("Plugin %s has no %s (%s)",path,CMDFS_PLUGIN_SYMBOL,dlerror());
+	}
+	else if ( api->abi != CMDFS_PLUGIN_ABI ) {
+		log_error("Plugin %s is for another version of cmdfs (ABI %d, not %d)",path,api->abi,CMDFS_PLUGIN_ABI);
+	}
+	else if ( !api->transform && !api->map ) {
+		log_error("Plugin %s has no transform",path);
+	}
+	else {
+		plugin_t *rv = calloc(1,sizeof(plugin_t));
+		rv->handle = handle;
+		rv->api = api;
+		if ( !api->init || (rv->state = api->init(opts)) ) {
+			log_debug("Plugin %s loaded%s",api->name,api->map ? ", applied when reading" : "");
+			return rv;
+		}
+		log_error("Plugin %s failed to start with options %s",api->name,opts);
+		free(rv);
+	}
+	dlclose(handle);
+	return NULL;
+}
+
+/*
+ * Whether the plugin is applied as files are read, rather than cached
+ */
+int plugin_maps( plugin_t *p ) {
+	return p->api->map != NULL;
+}
+
+/*
+ * Transform source file src, passing the output to sink. Returns 0 on
+ * success, the plugin's non-zero result on failure or -1 if src can't be
+ * read.
+ */
+int plugin_transform( plugin_t *p, const char *src, cmdfs_sink_t sink, void *data ) {
+	int in = open(src,O_RDONLY | O_CLOEXEC);
+	if ( in < 0 ) {
+		log_error("Opening source file %s for read (%s)",src,strerror(errno));
+		return -1;
+	}
+	int rv;
+	if ( p->api->transform ) {
+		rv = p->api->transform(p->state,in,sink,data);
+	}
+	else {
+		// a map only plugin, applied as the source is read
+		char buf[65536];
+		ssize_t n;
+		off_t offset = 0;
+		while ( (n = read(in,buf,sizeof(buf))) > 0 ) {
+			p->api->map(p->state,buf,n,offset);
+			if ( sink(data,buf,n) )
+				break;
+			offset += n;
+		}
+		rv = n != 0;
+	}
+	close(in);
+	return rv;
+}
+
+void plugin_map( plugin_t *p, char *buf, size_t size, off_t offset ) {
+	p->api->map(p->state,buf,size,offset);
+}
+
+void plugin_destroy( plugin_t *p ) {
+	if ( p->api->fini )
+		p->api->fini(p->state);
+	dlclose(p->handle);
+	free(p);
+}
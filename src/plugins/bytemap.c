@@ -0,0 +1,85 @@
+/*
+	Cmdfs2 : plugins/bytemap.c
+
+	Reference plugin replacing bytes, as tr(1) does. plugin-opts is the bytes
+	to replace and their replacements separated by a colon, each a list of
+	bytes and ranges such as a-z, or "rot13". If there are fewer replacements
+	the last is repeated. Each byte is mapped on its own, so files are read
+	straight from the source through bytemap_map and never cached.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs_plugin.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ROT13 "a-zA-Z:n-za-mN-ZA-M"
+
+/*
+ * Expand the bytes and ranges in spec, up to end, into set. Returns the
+ * number of bytes.
+ */
+static int bytemap_expand( const char *spec, const char *end, unsigned char set[256] ) {
+	int n = 0;
+	for ( const unsigned char *c = (const unsigned char *)spec; c < (const unsigned char *)end && n < 256; c++ ) {
+		if ( c+2 < (const unsigned char *)end && c[1] == '-' && c[2] >= c[0] ) {
+			for ( int b = c[0]; b <= c[2] && n < 256; b++ )
+				set[n++] = b;
+			c += 2;
+		}
+		else
+			set[n++] = *c;
+	}
+	return n;
+}
+
+static void *bytemap_init( const char *opts ) {
+	if ( opts && !strcmp(opts,"rot13") )
+		opts = ROT13;
+	const char *colon = opts ? strchr(opts,':') : NULL;
+	if ( !colon )
+		return NULL;
+	unsigned char from[256], to[256];
+	int nfrom = bytemap_expand(opts,colon,from);
+	int nto = bytemap_expand(colon+1,colon+strlen(colon),to);
+	if ( !nto )
+		return NULL;
+	unsigned char *table = malloc(256);
+	for ( int b = 0; b < 256; b++ )
+		table[b] = b;
+	for ( int i = 0; i < nfrom; i++ )
+		table[from[i]] = to[i < nto ? i : nto-1];
+	return table;
+}
+
+static void bytemap_map( void *state, char *buf, size_t size, off_t offset ) {
+	const unsigned char *table = state;
+	for ( size_t i = 0; i < size; i++ )
+		buf[i] = table[(unsigned char)buf[i]];
+}
+
+static void bytemap_fini( void *state ) {
+	free(state);
+}
+
+const cmdfs_plugin_t cmdfs_plugin = {
+	.abi = CMDFS_PLUGIN_ABI,
+	.name = "bytemap",
+	.init = bytemap_init,
+	.map = bytemap_map,
+	.fini = bytemap_fini
+};
@@ -0,0 +1,85 @@
+/*
+	Cmdfs2 : plugins/gunzip.c
+
+	Reference plugin decompressing gzip or zlib files, as gzip -dc would.
+	Concatenated gzip members are decompressed one after another. Takes no
+	options.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs_plugin.h"
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define BUFFER 65536
+#define AUTO_HEADER 32	// added to the window bits, gzip or zlib header detected
+
+static int gunzip_transform( void *state, int in, cmdfs_sink_t sink, void *data ) {
+	unsigned char inbuf[BUFFER];
+	unsigned char outbuf[BUFFER];
+	z_stream z = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+	if ( inflateInit2(&z,MAX_WBITS + AUTO_HEADER) != Z_OK )
+		return -1;
+	int rv = Z_OK;
+	ssize_t n;
+	while ( rv != Z_DATA_ERROR && (n = read(in,inbuf,sizeof(inbuf))) != 0 ) {
+		if ( n < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			break;
+		}
+		z.next_in = inbuf;
+		z.avail_in = n;
+		while ( z.avail_in ) {
+			if ( rv == Z_STREAM_END )
+				inflateReset(&z); // another member follows
+			z.next_out = outbuf;
+			z.avail_out = sizeof(outbuf);
+			rv = inflate(&z,Z_NO_FLUSH);
+			if ( rv == Z_BUF_ERROR ) {
+				rv = Z_OK; // no progress this time, not an error
+			}
+			else if ( rv != Z_OK && rv != Z_STREAM_END ) {
+				rv = Z_DATA_ERROR;
+				break;
+			}
+			if ( z.avail_out < sizeof(outbuf) && sink(data,(const char *)outbuf,sizeof(outbuf)-z.avail_out) ) {
+				rv = Z_DATA_ERROR;
+				break;
+			}
+		}
+	}
+	// flush anything still held back
+	while ( rv == Z_OK ) {
+		z.next_out = outbuf;
+		z.avail_out = sizeof(outbuf);
+		rv = inflate(&z,Z_FINISH);
+		if ( z.avail_out < sizeof(outbuf) && sink(data,(const char *)outbuf,sizeof(outbuf)-z.avail_out) )
+			rv = Z_DATA_ERROR;
+		else if ( rv == Z_BUF_ERROR && !z.avail_out )
+			rv = Z_OK; // more to come, otherwise the input was truncated
+	}
+	inflateEnd(&z);
+	return rv != Z_STREAM_END;
+}
+
+const cmdfs_plugin_t cmdfs_plugin = {
+	.abi = CMDFS_PLUGIN_ABI,
+	.name = "gunzip",
+	.transform = gunzip_transform
+};
@@ -0,0 +1,184 @@
+/*
+	Cmdfs2 : rules.c
+
+	File selection rules. Extensions are held in a hash set looked up by the
+	suffixes of a file's name, and the path and exclude regular expressions
+	are each merged into a single alternation so a path is matched in one
+	pass (glibc runs these on a lazily built DFA) rather than once per
+	expression.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <ctype.h>
+
+static void re_set_init( re_set_t *set, const char *kind ) {
+	memset(set,0,sizeof(re_set_t));
+	set->kind = kind;
+}
+
+static int re_set_add( re_set_t *set, const char *re ) {
+	regex_t check;
+	int err = regcomp(&check,re,REG_NOSUB);
+	if ( err ) {
+		size_t length = regerror(err,&check,NULL,0);
+		char buffer[length];
+		regerror(err,&check,buffer,length);
+		log_error("Error compiling %s regex: %s",set->kind,buffer);
+		return err;
+	}
+	regfree(&check);
+	set->patterns = realloc(set->patterns,sizeof(char *)*(set->count+1));
+	set->patterns[set->count++] = strdup(re);
+	return 0;
+}
+
+// back references are numbered by group so can't be merged with other expressions
+static int has_backref( const char *re ) {
+	for ( const char *s = re; *s; s++ ) {
+		if ( *s == '\\' && s[1] ) {
+			if ( isdigit((unsigned char)s[1]) && s[1] != '0' )
+				return 1;
+			s++;
+		}
+	}
+	return 0;
+}
+
+static void re_set_compile( re_set_t *set ) {
+	if ( !set->count )
+		return;
+	// \(re1\)\|\(re2\)... in (GNU) basic syntax, as the expressions were given
+	size_t length = 1;
+	for ( int i = 0; i < set->count; i++ )
+		length += strlen(set->patterns[i]) + 6;
+	char combined[length];
+	combined[0] = '\0';
+	int merged = 0;
+	set->separate = calloc(set->count,sizeof(regex_t));
+	for ( int i = 0; i < set->count; i++ ) {
+		if ( has_backref(set->patterns[i]) ) {
+			regcomp(set->separate+set->separate_cnt++,set->patterns[i],REG_NOSUB);
+		}
+		else {
+			if ( merged++ )
+				strcat(combined,"\\|");
+			strcat(combined,"\\(");
+			strcat(combined,set->patterns[i]);
+			strcat(combined,"\\)");
+		}
+	}
+	if ( merged ) {
+		if ( !regcomp(&set->combined,combined,REG_NOSUB) ) {
+			set->has_combined = 1;
+		}
+		else {
+			// shouldn't happen as each compiled alone, but don't lose any
+			log_warning("Unable to combine %s regexs, matching separately",set->kind);
+			for ( int i = 0; i < set->count; i++ ) {
+				if ( !has_backref(set->patterns[i]) )
+					regcomp(set->separate+set->separate_cnt++,set->patterns[i],REG_NOSUB);
+			}
+		}
+	}
+}
+
+static int re_set_match( re_set_t *set, const char *path ) {
+	if ( set->has_combined && !regexec(&set->combined,path,0,NULL,0) )
+		return 1;
+	for ( int i = 0; i < set->separate_cnt; i++ ) {
+		if ( !regexec(set->separate+i,path,0,NULL,0) )
+			return 1;
+	}
+	return 0;
+}
+
+static void re_set_free( re_set_t *set ) {
+	for ( int i = 0; i < set->count; i++ )
+		free(set->patterns[i]);
+	free(set->patterns);
+	if ( set->has_combined )
+		regfree(&set->combined);
+	for ( int i = 0; i < set->separate_cnt; i++ )
+		regfree(set->separate+i);
+	free(set->separate);
+}
+
+rules_t *rules_create() {
+	rules_t *rv = calloc(1,sizeof(rules_t));
+	rv->extensions = htable_create(str_hash,str_equal);
+	re_set_init(&rv->paths,"path");
+	re_set_init(&rv->excludes,"exclude");
+	return rv;
+}
+
+int rules_add_extension( rules_t *r, const char *ext ) {
+	char *lower = strdup(ext);
+	for ( char *s = lower; *s; s++ )
+		*s = tolower((unsigned char)*s);
+	if ( !*lower || htable_get(r->extensions,lower) )
+		free(lower);
+	else
+		htable_put(r->extensions,lower,lower);
+	return 0;
+}
+
+int rules_add_path_re( rules_t *r, const char *re ) {
+	return re_set_add(&r->paths,re);
+}
+
+int rules_add_exclude_re( rules_t *r, const char *re ) {
+	return re_set_add(&r->excludes,re);
+}
+
+void rules_compile( rules_t *r ) {
+	re_set_compile(&r->paths);
+	re_set_compile(&r->excludes);
+}
+
+int rules_excluded( rules_t *r, const char *path ) {
+	return re_set_match(&r->excludes,path);
+}
+
+int rules_match( rules_t *r, const char *path ) {
+	if ( r->extensions->count ) {
+		// try each suffix of the file name (so tar.gz can match), case insensitive
+		const char *name = strrchr(path,'/');
+		name = name ? name+1 : path;
+		char lower[strlen(name)+1];
+		for ( int i = 0; (lower[i] = tolower((unsigned char)name[i])); i++ )
+			;
+		for ( const char *dot = strchr(lower,'.'); dot; dot = strchr(dot+1,'.') ) {
+			if ( htable_get(r->extensions,dot+1) )
+				return 1;
+		}
+	}
+	return re_set_match(&r->paths,path);
+}
+
+static int rules_free_extension( const void *key, void *value, void *data ) {
+	free(value);
+	return 0;
+}
+
+void rules_destroy( rules_t *r ) {
+	htable_visit(r->extensions,rules_free_extension,NULL);
+	htable_destroy(r->extensions);
+	re_set_free(&r->paths);
+	re_set_free(&r->excludes);
+	free(r);
+}
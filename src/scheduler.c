@@ -0,0 +1,158 @@
+/*
+	Cmdfs2 : scheduler.c
+
+	Transform scheduler. A fixed pool of worker threads which run queued
+	jobs (typically a transform command) so that the number of concurrent
+	transforms is bounded, and FUSE threads only block while their own job
+	is outstanding.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <pthread.h>
+
+struct job_s {
+	int (*fn)(void *);
+	void *arg;
+	int result;
+	int done;
+	int detached;				// submitted, nobody waiting so free when run
+	pthread_cond_t done_cond;	// signalled when job has been run
+	struct job_s *next;
+};
+
+static __thread scheduler_t *worker_of = NULL; // scheduler the current thread works for
+
+static void *scheduler_worker( void *_scheduler ) {
+	scheduler_t *s = (scheduler_t *)_scheduler;
+	worker_of = s;
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while ( !s->head && !s->stop )
+			pthread_cond_wait(&s->work,&s->lock);
+		job_t *job = s->head;
+		if ( !job )
+			break; // stopped and queue drained
+		s->head = job->next;
+		if ( !s->head )
+			s->tail = NULL;
+		s->queued--;
+		s->running++;
+		pthread_mutex_unlock(&s->lock);
+
+		int result = job->fn(job->arg);
+
+		pthread_mutex_lock(&s->lock);
+		s->running--;
+		if ( job->detached ) {
+			free(job);
+			continue;
+		}
+		job->result = result;
+		job->done = 1;
+		pthread_cond_signal(&job->done_cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+scheduler_t *scheduler_create( int workers ) {
+	assert(workers > 0);
+	scheduler_t *rv = calloc(1,sizeof(scheduler_t));
+	pthread_mutex_init(&rv->lock,NULL);
+	pthread_cond_init(&rv->work,NULL);
+	rv->threads = calloc(workers,sizeof(pthread_t));
+	for ( int i = 0; i < workers; i++ ) {
+		int rc = pthread_create(rv->threads+rv->workers,NULL,scheduler_worker,rv);
+		if ( rc )
+			log_error("Failed to create transform worker %d (%s)",i,strerror(rc)); // returned, errno isn't set
+		else
+			rv->workers++;
+	}
+	if ( !rv->workers ) {
+		scheduler_destroy(rv);
+		rv = NULL;
+	}
+	return rv;
+}
+
+// call with lock held
+static void scheduler_queue( scheduler_t *s, job_t *job ) {
+	if ( s->tail )
+		s->tail->next = job;
+	else
+		s->head = job;
+	s->tail = job;
+	s->queued++;
+	if ( s->queued > s->workers - s->running )
+		log_debug("Transform queued behind %d others (%d workers busy)",s->queued-1,s->running);
+	pthread_cond_signal(&s->work);
+}
+
+/*
+ * Queue fn(arg) and block until a worker has run it. The job lives on the
+ * caller's stack, so nothing is allocated per request.
+ */
+int scheduler_run( scheduler_t *s, int (*fn)(void *), void *arg ) {
+	if ( worker_of == s )
+		return fn(arg); // a job waiting on other workers could leave them all waiting
+	job_t job = { .fn = fn, .arg = arg };
+	pthread_cond_init(&job.done_cond,NULL);
+
+	pthread_mutex_lock(&s->lock);
+	scheduler_queue(s,&job);
+	while ( !job.done )
+		pthread_cond_wait(&job.done_cond,&s->lock);
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_cond_destroy(&job.done_cond);
+	return job.result;
+}
+
+int scheduler_is_worker( scheduler_t *s ) {
+	return s && worker_of == s;
+}
+
+/*
+ * Queue fn(arg) without waiting for it, its result is discarded
+ */
+void scheduler_submit( scheduler_t *s, int (*fn)(void *), void *arg ) {
+	job_t *job = calloc(1,sizeof(job_t));
+	job->fn = fn;
+	job->arg = arg;
+	job->detached = 1;
+	pthread_mutex_lock(&s->lock);
+	scheduler_queue(s,job);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Destroy scheduler s. Workers finish any queued jobs first so no caller is
+ * left waiting.
+ */
+void scheduler_destroy( scheduler_t *s ) {
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->work);
+	pthread_mutex_unlock(&s->lock);
+	for ( int i = 0; i < s->workers; i++ )
+		pthread_join(s->threads[i],NULL);
+	pthread_cond_destroy(&s->work);
+	pthread_mutex_destroy(&s->lock);
+	free(s->threads);
+	free(s);
+}
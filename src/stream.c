@@ -0,0 +1,246 @@
+/*
+	Cmdfs2 : stream.c
+
+	Progressive reads. The command's output is pumped from a pipe into the
+	new cache file by a transform worker, so readers can be served the part
+	already written while the command is still running. Readers wanting more
+	wait for the worker to report progress. The output is published once
+	complete, like any other.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#define STREAM_BUFFER 65536
+
+extern options_t options;
+extern scheduler_t *scheduler;
+extern index_t *cache_index;
+extern cleaner_t *cleaner;
+extern coprocs_t *coprocs;
+extern plugin_t *plugin;
+
+// call with lock held
+static void stream_unref( streams_t *ss, stream_t *s ) {
+	if ( --s->refs == 0 ) {
+		if ( s->fd >= 0 )
+			close(s->fd);
+		if ( s->rfd >= 0 )
+			close(s->rfd);
+		pthread_cond_destroy(&s->progress);
+		file_destroy(s->f);
+		free(s);
+	}
+}
+
+/*
+ * Append output to the cache file and wake readers waiting for it. Only the
+ * pump writes s->written, so it can read it unlocked.
+ */
+static int stream_append( void *_s, const char *buf, size_t size ) {
+	stream_t *s = (stream_t *)_s;
+	if ( pwrite(s->fd,buf,size,s->written) != (ssize_t)size ) {
+		log_error("Writing cache file %s (%s)",file_get_cached_path(s->f),strerror(errno));
+		return -1;
+	}
+	pthread_mutex_lock(&s->owner->lock);
+	s->written += size;
+	pthread_cond_broadcast(&s->progress);
+	pthread_mutex_unlock(&s->owner->lock);
+	return 0;
+}
+
+/*
+ * Run the command for a stream, or have the plugin or a co-process transform
+ * it, copying the output to the cache file and waking readers as it arrives. Runs on a
+ * transform worker.
+ */
+static int stream_pump( void *_s ) {
+	stream_t *s = (stream_t *)_s;
+	streams_t *ss = s->owner;
+	const char *cached = file_get_cached_path(s->f);
+	struct stat ssrc;
+	struct stat scache;
+	int indexable = cache_index && !stat(file_get_src(s->f),&ssrc); // output will reflect source as it is now
+	int status = -1;
+	int failed = 0;
+	int pipefd[2];
+	if ( plugin ) {
+		status = plugin_transform(plugin,file_get_src(s->f),stream_append,s);
+	}
+	else if ( coprocs ) {
+		status = coprocs_run(coprocs,file_get_src(s->f),stream_append,s);
+	}
+	else if ( pipe2(pipefd,O_CLOEXEC) ) { // other children mustn't hold the write end open
+		log_error("Creating pipe for %s (%s)",cached,strerror(errno));
+	}
+	else {
+		pid_t pid = file_spawn(s->f,pipefd[1]);
+		close(pipefd[1]);
+		if ( pid > 0 ) {
+			char buf[STREAM_BUFFER];
+			ssize_t n;
+			while ( (n = read(pipefd[0],buf,sizeof(buf))) != 0 ) {
+				if ( n < 0 ) {
+					if ( errno == EINTR )
+						continue;
+					log_error("Reading command output for %s (%s)",cached,strerror(errno));
+					failed = 1;
+					break;
+				}
+				if ( !failed && stream_append(s,buf,n) )
+					failed = 1; // keep draining so the command isn't left blocked
+			}
+			if ( waitpid(pid,&status,0) < 0 ) {
+				log_error("Wait for command failed: %s (%s)",file_get_command(s->f),strerror(errno));
+				status = -1;
+			}
+		}
+		close(pipefd[0]);
+	}
+	if ( failed && !status )
+		status = -1;
+
+	if ( (status = file_publish(s->f,status)) ) {
+		file_decache(s->f);
+		log_warning("Command returned %s non-zero status %d (decached)",file_get_command(s->f),status);
+	}
+	else {
+		if ( options.dedup )
+			dedup_store(s->f);
+		if ( !stat(cached,&scache) ) {
+			if ( indexable )
+				index_update(cache_index,file_get_dest(s->f),cached+strlen(options.cache_dir)+1,&ssrc,&scache);
+			if ( cleaner )
+				cleaner_add(cleaner,cached+strlen(options.cache_dir)+1,&scache);
+		}
+	}
+
+	pthread_mutex_lock(&ss->lock);
+	htable_remove(ss->active,cached); // later opens use the cache file as is
+	file_flight_finish(s->f,status);
+	close(s->fd);
+	s->fd = -1;
+	s->status = status;
+	s->done = 1;
+	pthread_cond_broadcast(&s->progress);
+	stream_unref(ss,s);
+	pthread_mutex_unlock(&ss->lock);
+	return status;
+}
+
+streams_t *streams_create() {
+	streams_t *rv = calloc(1,sizeof(streams_t));
+	rv->active = htable_create(str_hash,str_equal);
+	pthread_mutex_init(&rv->lock,NULL);
+	return rv;
+}
+
+/*
+ * Return the stream generating f, starting one if f isn't cached. Returns
+ * NULL if the cache file is up to date or if it can't be streamed, in which
+ * case f should be read as normal.
+ */
+stream_t *stream_open( streams_t *ss, vfile_t *f ) {
+	const char *cached = file_get_cached_path(f);
+	if ( file_serve_stale(f) )
+		return NULL; // read the old output while the new is generated
+	if ( options.dedup && !file_is_cached(f) && dedup_fetch(f) )
+		return NULL; // identical output already there, hashed outside the lock
+	pthread_mutex_lock(&ss->lock);
+	stream_t *rv = htable_get(ss->active,cached);
+	if ( rv ) {
+		rv->refs++;
+	}
+	else if ( !file_is_cached(f) && file_flight_start(f) ) { // else being generated, wait for that in file_encache()
+		int rfd;
+		int fd = file_create_new(f,&rfd);
+		if ( fd < 0 ) {
+			file_flight_finish(f,-1);
+		}
+		else {
+			rv = calloc(1,sizeof(stream_t));
+			rv->owner = ss;
+			rv->f = file_create_from_src(file_get_src(f));
+			if ( f->blob )
+				rv->f->blob = strdup(f->blob); // don't hash the source twice
+			rv->fd = fd;
+			rv->rfd = rfd;
+			rv->refs = 2; // caller and worker
+			pthread_cond_init(&rv->progress,NULL);
+			htable_put(ss->active,file_get_cached_path(rv->f),rv);
+			scheduler_submit(scheduler,stream_pump,rv);
+			log_debug("Streaming %s",cached);
+		}
+	}
+	pthread_mutex_unlock(&ss->lock);
+	return rv;
+}
+
+/*
+ * Wait until there's output past offset or the command has finished. Returns
+ * how much of size can be read from s->rfd at offset, or -EIO if the command
+ * failed. Like a pipe, this may be short before the end.
+ */
+ssize_t stream_wait( streams_t *ss, stream_t *s, size_t size, off_t offset ) {
+	pthread_mutex_lock(&ss->lock);
+	while ( !s->done && s->written <= offset )
+		pthread_cond_wait(&s->progress,&ss->lock);
+	ssize_t rv = size;
+	if ( s->done && s->status )
+		rv = -EIO;
+	else if ( !s->done && s->written - offset < (off_t)size )
+		rv = s->written - offset;
+	pthread_mutex_unlock(&ss->lock);
+	return rv;
+}
+
+int stream_read( streams_t *ss, stream_t *s, char *buf, size_t size, off_t offset ) {
+	ssize_t available = stream_wait(ss,s,size,offset);
+	if ( available < 0 )
+		return available;
+	int rv = pread(s->rfd,buf,available,offset);
+	return rv < 0 ? -errno : rv;
+}
+
+/*
+ * Return the number of bytes of output so far
+ */
+off_t stream_written( streams_t *ss, stream_t *s ) {
+	pthread_mutex_lock(&ss->lock);
+	off_t rv = s->written;
+	pthread_mutex_unlock(&ss->lock);
+	return rv;
+}
+
+void stream_release( streams_t *ss, stream_t *s ) {
+	pthread_mutex_lock(&ss->lock);
+	stream_unref(ss,s);
+	pthread_mutex_unlock(&ss->lock);
+}
+
+/*
+ * Destroy ss, once the transform workers have finished
+ */
+void streams_destroy( streams_t *ss ) {
+	htable_destroy(ss->active);
+	pthread_mutex_destroy(&ss->lock);
+	free(ss);
+}
@@ -23,6 +23,7 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <stdint.h>
 
 int path_max(const char *dirpath) {
 	int pathmax = pathconf(dirpath, _PC_PATH_MAX);
@@ -101,26 +102,125 @@ char *tokens_substitute(const char *str, const char *tokens[], const char *value
 }
 
 
+// 64 bit finaliser from MurmurHash3
+static uint64_t fmix64( uint64_t k ) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/*
+ * Format a 128 bit digest as a fixed length name fanned out into two levels
+ * of subdirectory eg "3f/a0/3fa0...". Returns allocated string
+ */
+char *shard_name( uint64_t h1, uint64_t h2 ) {
+	char *rv = malloc(HASH_PATH_LEN+1);
+	sprintf(rv,"%02x/%02x/%016llx%016llx",(unsigned)(h1 >> 56),(unsigned)(h1 >> 48) & 0xff,
+		(unsigned long long)h1,(unsigned long long)h2);
+	return rv;
+}
+
 /*
- * Given a path name return a filename uniquely representing it
+ * 128 bit digest of string str, into h[2]
+ */
+void hash_string( const char *str, uint64_t h[2] ) {
+	uint64_t h1 = 0xcbf29ce484222325ULL; // FNV-1a
+	uint64_t h2 = 5381; // djb2, independent of h1
+	size_t length = 0;
+	for ( const unsigned char *s = (const unsigned char *)str; *s; s++, length++ ) {
+		h1 = (h1 ^ *s) * 0x100000001b3ULL;
+		h2 = h2 * 33 + *s;
+	}
+	h[0] = fmix64(h1 ^ length);
+	h[1] = fmix64(h2 + h[0]);
+}
+
+/*
+ * Given a path name return a fixed length name uniquely representing it (see
+ * shard_name). Returns allocated string
  */
 const char *hash_path(const char *path) {
-	char *rv = malloc(strlen(path)*2+1);
-	const char *s = path;
-	char *d = rv;
+	uint64_t h[2];
+	hash_string(path,h);
+	return shard_name(h[0],h[1]);
+}
+
+#define ROTL64(x,r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define HASH_BUFFER 65536 // multiple of the 16 byte block
+
+/*
+ * 128 bit MurmurHash3 (x64) of everything read from fd, into h[2]. Returns 0,
+ * or -1 if fd could not be read
+ */
+int hash_content( int fd, uint64_t h[2] ) {
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0, h2 = 0;
+	uint64_t length = 0;
+	unsigned char *buf = malloc(HASH_BUFFER);
+	size_t got;
 	do {
-		switch (*s) {
-		case '/':
-			*d++ = '$'; break;
-		case '$':
-			*d++ = *s;
-			/* no break */
-		default:
-			*d++ = *s; break;
+		// fill the buffer so only the last one can have a partial block
+		got = 0;
+		while ( got < HASH_BUFFER ) {
+			ssize_t n = read(fd,buf+got,HASH_BUFFER-got);
+			if ( n < 0 && errno == EINTR )
+				continue;
+			if ( n < 0 ) {
+				free(buf);
+				return -1;
+			}
+			if ( !n )
+				break;
+			got += n;
 		}
-	}
-	while ( *s++ );
-	return rv;
+		length += got;
+		size_t blocks = got / 16;
+		for ( size_t i = 0; i < blocks; i++ ) {
+			uint64_t k1, k2;
+			memcpy(&k1,buf+i*16,8);
+			memcpy(&k2,buf+i*16+8,8);
+			k1 *= c1; k1 = ROTL64(k1,31); k1 *= c2; h1 ^= k1;
+			h1 = ROTL64(h1,27); h1 += h2; h1 = h1*5+0x52dce729;
+			k2 *= c2; k2 = ROTL64(k2,33); k2 *= c1; h2 ^= k2;
+			h2 = ROTL64(h2,31); h2 += h1; h2 = h2*5+0x38495ab5;
+		}
+		if ( got < HASH_BUFFER ) {
+			const unsigned char *tail = buf + blocks*16;
+			uint64_t k1 = 0, k2 = 0;
+			switch ( got & 15 ) {
+			case 15: k2 ^= ((uint64_t)tail[14]) << 48; /* no break */
+			case 14: k2 ^= ((uint64_t)tail[13]) << 40; /* no break */
+			case 13: k2 ^= ((uint64_t)tail[12]) << 32; /* no break */
+			case 12: k2 ^= ((uint64_t)tail[11]) << 24; /* no break */
+			case 11: k2 ^= ((uint64_t)tail[10]) << 16; /* no break */
+			case 10: k2 ^= ((uint64_t)tail[ 9]) << 8; /* no break */
+			case  9: k2 ^= ((uint64_t)tail[ 8]);
+				k2 *= c2; k2 = ROTL64(k2,33); k2 *= c1; h2 ^= k2;
+				/* no break */
+			case  8: k1 ^= ((uint64_t)tail[ 7]) << 56; /* no break */
+			case  7: k1 ^= ((uint64_t)tail[ 6]) << 48; /* no break */
+			case  6: k1 ^= ((uint64_t)tail[ 5]) << 40; /* no break */
+			case  5: k1 ^= ((uint64_t)tail[ 4]) << 32; /* no break */
+			case  4: k1 ^= ((uint64_t)tail[ 3]) << 24; /* no break */
+			case  3: k1 ^= ((uint64_t)tail[ 2]) << 16; /* no break */
+			case  2: k1 ^= ((uint64_t)tail[ 1]) << 8; /* no break */
+			case  1: k1 ^= ((uint64_t)tail[ 0]);
+				k1 *= c1; k1 = ROTL64(k1,31); k1 *= c2; h1 ^= k1;
+			}
+		}
+	} while ( got == HASH_BUFFER );
+	free(buf);
+	h1 ^= length; h2 ^= length;
+	h1 += h2; h2 += h1;
+	h1 = fmix64(h1); h2 = fmix64(h2);
+	h1 += h2; h2 += h1;
+	h[0] = h1;
+	h[1] = h2;
+	return 0;
 }
 
 /*
@@ -137,6 +237,19 @@ const char* makepath( const char *path ) {
 	return rv;
 }
 
+/*
+ * Create the directories leading to path, below existing directory root
+ */
+void make_parents( const char *path, const char *root ) {
+	char dir[strlen(path)+1];
+	strcpy(dir,path);
+	for ( char *s = dir+strlen(root)+1; (s = strchr(s,'/')); s++ ) {
+		*s = '\0';
+		mkdir(dir,0777);
+		*s = '/';
+	}
+}
+
 /**
 * Traverse the directory tree rooted at root, calling vistor function for each directory entry recursively
 * Entry info is passed to visitor including full path, parent path, filename, mode
@@ -209,7 +322,9 @@ error:
 			for ( int i = 0; i < dircount; i++ ) {
 				if ( dirlist[i] ) free(dirlist[i]);
 			}
+			free(dirlist);
 		}
+		free(dpp);
 		if (fd ) closedir(fd);
 	}
 	return rv;
@@ -25,14 +25,17 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/file.h>
+#include <sys/xattr.h>
+#include <sys/mman.h>
 
-#define SHELL "/bin/sh" 		// shell exec
-#define SHELL_NAME "sh" 		// name to provide in argv[0]
-#define TOKEN "%f"				// token to substtue with filename
-#define FILE_ENV_VAR "INPUT_FILE"
 
 extern options_t options;
+extern scheduler_t *scheduler;
+extern index_t *cache_index;
+extern mime_t *mime;
+extern cleaner_t *cleaner;
+extern coprocs_t *coprocs;
+extern plugin_t *plugin;
 
 
 
@@ -85,130 +88,362 @@ const char *file_get_cached_path(vfile_t *f) {
 	return f->cached;
 }
 
+// tag cache file fd with the path it caches
+static void file_tag( vfile_t *f, int fd ) {
+	const char *dest = file_get_dest(f);
+	if ( fsetxattr(fd,CACHE_PATH_XATTR,dest,strlen(dest),0) && errno != ENOTSUP )
+		log_debug("Tagging cache file %s (%s)",file_get_cached_path(f),strerror(errno));
+}
+
+/*
+ * Open a file beside f's cache file for its new output, creating the cache
+ * subdirectories if need be, and tag it with the path it caches. If reader
+ * isn't NULL it is also opened for reading there. Returns the descriptor for
+ * writing or -1.
+ */
+int file_create_new( vfile_t *f, int *reader ) {
+	const char *cached = file_get_cached_path(f);
+	char tmp[strlen(cached)+sizeof(NEW_SUFFIX)];
+	sprintf(tmp,"%s%s",cached,NEW_SUFFIX);
+	int rv = open(tmp,O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0600);
+	if ( rv < 0 && errno == ENOENT ) {
+		make_parents(tmp,options.cache_dir); // first in this shard
+		rv = open(tmp,O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0600);
+	}
+	if ( rv >= 0 && reader && (*reader = open(tmp,O_RDONLY | O_CLOEXEC)) < 0 ) {
+		close(rv);
+		unlink(tmp);
+		rv = -1;
+	}
+	if ( rv < 0 )
+		log_error("Opening cache file %s for write (%s)",tmp,strerror(errno));
+	else
+		file_tag(f,rv);
+	return rv;
+}
+
+/*
+ * Once the new output for f is written, publish it by renaming it over the
+ * cache file if status is 0, or discard it if not. Readers with the old cache
+ * file open keep reading that. Returns status, or -1 if it couldn't be
+ * published.
+ */
+int file_publish( vfile_t *f, int status ) {
+	const char *cached = file_get_cached_path(f);
+	char tmp[strlen(cached)+sizeof(NEW_SUFFIX)];
+	sprintf(tmp,"%s%s",cached,NEW_SUFFIX);
+	if ( !status && rename(tmp,cached) ) {
+		log_error("Publishing cache file %s (%s)",cached,strerror(errno));
+		status = -1;
+	}
+	if ( status )
+		unlink(tmp);
+	return status;
+}
+
+/*
+ * Single-flight registry. Each cache file being generated has a flight, and
+ * anyone else needing it waits for that to land rather than generating it
+ * again.
+ */
+typedef struct {
+	char *cached;
+	int landed;
+	int status;
+	int waiters;
+	pthread_cond_t landing;
+} flight_t;
+
+static htable_t *flights = NULL;	// cache path -> flight_t
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Start a flight for f's cache file. Returns 1 if started, in which case the
+ * caller generates it and calls file_flight_finish(), or 0 if one is already
+ * underway.
+ */
+int file_flight_start( vfile_t *f ) {
+	const char *cached = file_get_cached_path(f);
+	int rv = 0;
+	pthread_mutex_lock(&flights_lock);
+	if ( !flights )
+		flights = htable_create(str_hash,str_equal);
+	if ( !htable_get(flights,cached) ) {
+		flight_t *fl = calloc(1,sizeof(flight_t));
+		fl->cached = strdup(cached);
+		pthread_cond_init(&fl->landing,NULL);
+		htable_put(flights,fl->cached,fl);
+		rv = 1;
+	}
+	pthread_mutex_unlock(&flights_lock);
+	return rv;
+}
+
+static void flight_free( flight_t *fl ) {
+	pthread_cond_destroy(&fl->landing);
+	free(fl->cached);
+	free(fl);
+}
+
+/*
+ * Wait for the flight underway for f's cache file. Returns its status, or 0 if
+ * there wasn't one.
+ */
+int file_flight_wait( vfile_t *f ) {
+	int rv = 0;
+	pthread_mutex_lock(&flights_lock);
+	flight_t *fl = flights ? htable_get(flights,file_get_cached_path(f)) : NULL;
+	if ( fl ) {
+		fl->waiters++;
+		while ( !fl->landed )
+			pthread_cond_wait(&fl->landing,&flights_lock);
+		rv = fl->status;
+		if ( !--fl->waiters )
+			flight_free(fl);
+	}
+	pthread_mutex_unlock(&flights_lock);
+	return rv;
+}
+
+void file_flight_finish( vfile_t *f, int status ) {
+	pthread_mutex_lock(&flights_lock);
+	flight_t *fl = htable_remove(flights,file_get_cached_path(f));
+	fl->landed = 1;
+	fl->status = status;
+	pthread_cond_broadcast(&fl->landing);
+	if ( !fl->waiters )
+		flight_free(fl);
+	pthread_mutex_unlock(&flights_lock);
+}
+
+/*
+ * Start the command for f with its output going to out. Returns the child's
+ * pid, or -1 if it could not be started.
+ */
+pid_t file_spawn( vfile_t *f, int out ) {
+	const char *src = file_get_src(f);
+	int infile = open(src,O_RDONLY | O_CLOEXEC);
+	if ( infile < 0 ) {
+		log_error("Opening source file %s for read (%s)",src,strerror(errno));
+		return -1;
+	}
+	pid_t pid = command_spawn(options.template,src,infile,out);
+	close(infile);
+	return pid;
+}
+
+/*
+ * Return whether f has a cached file that is neither expired nor older than
+ * its source
+ */
+int file_is_cached( vfile_t *f ) {
+	struct stat scache;
+	struct stat ssrc;
+	return !stat(file_get_cached_path(f),&scache) && S_ISREG(scache.st_mode) &&
+		!(options.cache_expiry >= 0 && (time(NULL) - scache.st_mtime) > options.cache_expiry) &&
+		!(!stat(file_get_src(f),&ssrc) && scache.st_mtime < ssrc.st_mtime);
+}
+
+// plugin and co-process output sink, writing to a file descriptor
+static int file_write_output( void *_fd, const char *buf, size_t size ) {
+	int fd = *(int *)_fd;
+	while ( size > 0 ) {
+		ssize_t n = write(fd,buf,size);
+		if ( n < 0 && errno != EINTR ) {
+			log_error("Writing output to cache file (%s)",strerror(errno));
+			return -1;
+		}
+		if ( n > 0 ) {
+			buf += n;
+			size -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Run the command for f, or have the plugin or a co-process transform it,
+ * writing the output to outfile. Returns the command's exit status, or -1 if
+ * it could not be run.
+ */
+static int file_generate( vfile_t *f, int outfile ) {
+	int status = -1;
+	if ( plugin ) {
+		status = plugin_transform(plugin,file_get_src(f),file_write_output,&outfile);
+	}
+	else if ( coprocs ) {
+		status = coprocs_run(coprocs,file_get_src(f),file_write_output,&outfile);
+	}
+	else {
+		pid_t pid = file_spawn(f,outfile);
+		if ( pid > 0 && waitpid(pid,&status,0) < 0 ) {
+			log_error("Wait for command failed: %s (%s)",file_get_command(f),strerror(errno));
+			status = -1;
+		}
+	}
+	return status;
+}
+
+/*
+ * Generate the cache file for f, writing the output beside it and publishing
+ * it once complete. Returns the command's exit status, or -1 if it could not
+ * be run. Called on a scheduler worker thread when transform workers are
+ * enabled.
+ */
+static int file_transform( void *_f ) {
+	vfile_t *f = (vfile_t *)_f;
+	int outfile = file_create_new(f,NULL);
+	if ( outfile < 0 )
+		return -1;
+	int status = file_generate(f,outfile);
+	close(outfile);
+	return file_publish(f,status);
+}
+
+/*
+ * Regenerate a stale cache file in the background, for serve-stale mode. The
+ * old output is served until the new is published. Runs on a transform
+ * worker, f is its own.
+ */
+static int file_regenerate( void *_f ) {
+	vfile_t *f = (vfile_t *)_f;
+	const char *cached = file_get_cached_path(f);
+	struct stat ssrc;
+	struct stat scache;
+	int indexable = cache_index && !stat(file_get_src(f),&ssrc); // output will reflect source as it is now
+	int status = options.dedup && dedup_fetch(f) ? 0 : file_transform(f);
+	if ( status ) {
+		log_warning("Command returned %s non-zero status %d (stale output kept)",file_get_command(f),status);
+	}
+	else {
+		if ( options.dedup )
+			dedup_store(f);
+		if ( !stat(cached,&scache) ) {
+			if ( indexable )
+				index_update(cache_index,file_get_dest(f),cached+strlen(options.cache_dir)+1,&ssrc,&scache);
+			if ( cleaner )
+				cleaner_add(cleaner,cached+strlen(options.cache_dir)+1,&scache);
+		}
+		log_debug("Regenerated %s",cached);
+	}
+	file_flight_finish(f,status);
+	file_destroy(f);
+	return status;
+}
+
+/*
+ * If f's cache file is out of date but can be served while it's regenerated,
+ * in serve-stale mode, start regenerating it if that isn't already underway.
+ * Returns 1 if so, 0 if f must be generated before it's read.
+ */
+int file_serve_stale( vfile_t *f ) {
+	struct stat st;
+	if ( !options.serve_stale || !scheduler || file_is_cached(f) ||
+		 stat(file_get_cached_path(f),&st) || !S_ISREG(st.st_mode) )
+		return 0;
+	if ( file_flight_start(f) ) {
+		scheduler_submit(scheduler,file_regenerate,file_create_from_src(file_get_src(f)));
+		log_debug("Serving stale %s while it's regenerated",file_get_cached_path(f));
+	}
+	return 1;
+}
+
+/*
+ * Make sure f's cache file is up to date, generating it if not, and hold it
+ * open. Cache files are only ever published whole, so no locking is needed to
+ * read them. Returns the cache file path, or NULL if it can't be generated.
+ */
 const char *file_encache(vfile_t *f) {
 	struct stat scache;
 	struct stat ssrc;
 	const char *rv = file_get_cached_path(f);
 	const char *src = file_get_src(f);
 	int retry = 3;
-	if ( f->fdh == -1 ) {
-		f->fdh = open(rv,O_RDONLY); // hold open
-		if (f->fdh >= 0) {
-			// attempt to get an shared lock (non-blocking)
-			if ( flock(f->fdh,LOCK_SH | LOCK_NB) == -1 && errno == EWOULDBLOCK) {
-				// okay log info message and block until we get it
-				log_debug("Waiting on shared lock for cached file %s",rv);
-				if ( flock(f->fdh,LOCK_SH ) ) {
-					// couldn't caquire lock
-					log_error("Failed to acquire shared lock for %s (%s)",rv,strerror(errno));
-					// TODO something more sensible!
-				}
-				else
-					log_debug("Lock acquired for cached file %s",rv);
-			}
-			flock(f->fdh,LOCK_UN); // unlock now
-		}
-	}
 	do {
-		if ( (f->fdh == -1 && errno == ENOENT) || // no cached file
-			 (!fstat(f->fdh,&scache)  && // passed fstat
-			 ((options.cache_expiry >= 0 && (time(NULL) - scache.st_mtime) > options.cache_expiry) || // expired
-				(!stat(src,&ssrc) && scache.st_mtime < ssrc.st_mtime  )))) { // cache out of date
-			// re-creation needed
-			if (f->fdh >= 0)
-				close(f->fdh); // will reopen for write in child
-			char *command = token_substitute(file_get_command(f),TOKEN,src);
-			// kick off subprocess
-			int pid = fork();
-			if ( !pid ) {
-				int infile = open(src,O_RDONLY);
-				if ( infile < 0 ) {
-					log_error("Opening source file %s for read (%s)",src,strerror(errno));
-				}
-				else {
-					int outfile = open(rv,O_WRONLY | O_CREAT | O_TRUNC, 0);
-					if ( outfile < 0 ) {
-						log_error("Opening cache file %s for write (%s)",rv,strerror(errno));
-					}
-					else {
-						// subprocess attempt to get exclusive lock, will be released on exit
-						if ( flock(outfile,LOCK_EX | LOCK_NB) == -1 ) {
-							if (errno == EWOULDBLOCK) {
-								// This is unusual, my parent managed to get a shared lock just now but
-								// Someone else has got in and is now already recreating.I won't bother then, I'll just wait until
-								// I can get a shared lock then exit, when I should have a shiny new version created by someone else
-								log_debug("Waiting in subprocess for shared lock %s",rv);
-								if (flock(outfile,LOCK_SH))
-									log_error("Unable to obtain wait for completion of writing process on %s (%s)",rv,strerror(errno));
-								else
-									log_debug("File recreated by other process %s",rv);
-							}
-							else
-								log_error("Unable to obtain exclusive (write) lock on %s (%s)",strerror(errno));
-						}
-						else if ( !fchmod(outfile,0600) ) {
-							if (dup2(infile,STDIN_FILENO) != -1 ) {
-								if ( dup2(outfile,STDOUT_FILENO) != -1) {
-									char *envp[2];
-									if ( asprintf(&envp[0],"%s=%s",FILE_ENV_VAR,src) >= 0 ) {
-										envp[1] = NULL;
-										execle(SHELL,SHELL_NAME,"-c",command,NULL,envp);
-										log_error("execle failed %s (%s)",command, strerror(errno));
-									}
-									else
-										log_error("Creating child environment (%s)",strerror(errno));
-								}
-								else
-									log_error("Redirecting child output to file %s (%s)",rv,strerror(errno));
-							}
-							else
-								log_error("Redirecting child input from file %s (%s)",src,strerror(errno));
-						}
-						else
-							log_error("Setting cache file permissions file %s (%s)",rv,strerror(errno));
-					}
-				}
-				_exit(0);
-			}
-			else if ( pid < 0 ) {
-				log_error("Command launch failed: %s (%s)",command,strerror(errno));
+		if ( f->fdh == -1 && (f->fdh = open(rv,O_RDONLY | O_CLOEXEC)) < 0 && errno != ENOENT ) {
+			log_error("Opening cache file %s (%s)",rv,strerror(errno));
+			continue;
+		}
+		if ( f->fdh >= 0 && !fstat(f->fdh,&scache) &&
+			 !(options.cache_expiry >= 0 && (time(NULL) - scache.st_mtime) > options.cache_expiry) && // not expired
+			 !(!stat(src,&ssrc) && scache.st_mtime < ssrc.st_mtime) ) // nor out of date
+			break;
+		// re-creation needed
+		if ( f->fdh >= 0 && file_serve_stale(f) )
+			break; // old output served meanwhile
+		if ( f->fdh >= 0 ) {
+			close(f->fdh);
+			f->fdh = -1;
+		}
+		if ( !file_flight_start(f) ) {
+			// already being generated, use that
+			if ( scheduler_is_worker(scheduler) ) {
+				rv = NULL; // its generator may be queued behind this worker, leave it to them
+				break;
 			}
-			else {
-				int status = 0;
-				if ( waitpid(pid,&status,0) < 0 ) {
-					log_error("Wait for command failed: %s (%s)",command,strerror(errno));
-					rv = NULL;
-				}
-				if ( status ) {
-					file_decache(f);
-					log_warning("Command returned %s non-zero status %d (decached)",command,status);
-				}
-				else
-					f->fdh = open(rv,O_RDONLY); // hold open
-
+			int status = file_flight_wait(f);
+			if ( status < 0 )
+				rv = NULL;
+			if ( status )
+				break; // failed for us too, rather than every waiter running it again
+			continue;
+		}
+		int indexable = cache_index && !stat(src,&ssrc); // output will reflect source as it is now
+		// reuse identical output if deduplicating, else run on a transform worker if there's a pool, otherwise in this thread
+		int status = options.dedup && dedup_fetch(f) ? 0 :
+			scheduler ? scheduler_run(scheduler,file_transform,f) : file_transform(f);
+		if ( status < 0 ) {
+			rv = NULL;
+		}
+		else if ( status ) {
+			file_decache(f);
+			log_warning("Command returned %s non-zero status %d (decached)",file_get_command(f),status);
+		}
+		else if ( (f->fdh = open(rv,O_RDONLY | O_CLOEXEC)) >= 0 ) { // hold open
+			if ( options.dedup )
+				dedup_store(f);
+			if ( !fstat(f->fdh,&scache) ) {
+				if ( indexable )
+					index_update(cache_index,file_get_dest(f),rv+strlen(options.cache_dir)+1,&ssrc,&scache);
+				if ( cleaner )
+					cleaner_add(cleaner,rv+strlen(options.cache_dir)+1,&scache);
 			}
-			free(command);
 		}
+		file_flight_finish(f,status);
+		if ( !rv )
+			break;
 	} while ( f->fdh == -1  && --retry > 0 );
 	return rv;
 
 }
 
-int file_get_handle( vfile_t *f ) {
-	file_encache(f);
-	return f->fdh;
+/*
+ * Bring f's cache file up to date and hold it open for reading, mapped into
+ * memory with the mmap option. Done once when the file is opened, so reads
+ * need no further checks. Returns 0 or -errno.
+ */
+int file_open_cached( vfile_t *f ) {
+	if ( !file_encache(f) || f->fdh < 0 )
+		return -EIO;
+	struct stat st;
+	if ( options.mmap && !fstat(f->fdh,&st) && st.st_size > 0 ) {
+		// published whole and never rewritten, so the mapping stays valid
+		void *mem = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,f->fdh,0);
+		if ( mem != MAP_FAILED ) {
+			f->mem = mem;
+			f->mem_size = st.st_size;
+		}
+		else
+			log_warning("Mapping %s (%s), reading instead",file_get_cached_path(f),strerror(errno));
+	}
+	return 0;
 }
 
 const char *file_get_command(vfile_t *f) {
 	const char *src = file_get_src(f);
 	if ( src ) {
-		if (!f->command && options.exclude_regexp_cnt > 0 ) {
-			// Check path
-			for ( int i = 0; i < options.exclude_regexp_cnt; i++) {
-				if (!regexec(&options.exclude_regexps[i],src,0,NULL,0))
-					goto exitnow; // Explicitly excluded be re give up now
-			}
-		}
+		if (!f->command && rules_excluded(options.rules,src) )
+			goto exitnow; // Explicitly excluded be re give up now
 		if ( !f->command && options.fnmatch_c > 0) {
 			const char *filename = basename(src);
 			for ( int i = 0; !f->command && i < options.fnmatch_c; i++) {
@@ -216,37 +451,14 @@ const char *file_get_command(vfile_t *f) {
 					f->command = strdup(options.command);
 			}
 		}
-		if (!f->command && options.path_regexp_cnt > 0 ) {
-			// Check path
-			for ( int i = 0; !f->command && i < options.path_regexp_cnt; i++) {
-				if (!regexec(&options.path_regexps[i],src,0,NULL,0))
-					f->command = strdup(options.command);
-			}
+		if (!f->command && rules_match(options.rules,src) ) {
+			// Check extension and path
+			f->command = strdup(options.command);
 		}
-		if ( !f->command && options.mime_regexp_cnt > 0 ) {
+		if ( !f->command && options.mime_regexp_cnt > 0 && mime ) {
 			// Check mime
-			char *file_cmd,*mime = NULL;
-			size_t n = 0;
-			if ( asprintf( &file_cmd,"file -b -L --mime-type -e ascii %s",src ) < 0 ) {
-				log_debug("Cache filename: %s",strerror(errno));
-				return NULL;
-			}
-			else {
-
-				FILE *out = popen(file_cmd,"r");
-				if (out) {
-					if ( getline(&mime,&n,out) > 0 ) {
-						for ( int i = 0; !f->command && i < options.mime_regexp_cnt; i++) {
-							if (!regexec(&options.mime_regexps[i],mime,0,NULL,0))
-								f->command = strdup(options.command);
-						}
-					}
-					if ( mime )
-						free(mime);
-					pclose(out);
-				}
-				free(file_cmd);
-			}
+			if ( mime_match(mime,src) )
+				f->command = strdup(options.command);
 		}
 	}
 	else
@@ -259,8 +471,14 @@ void file_decache( vfile_t *f ) {
 	const char *cached = file_get_cached_path(f);
 	struct stat cst;
 	if ( cached && !stat(cached,&cst) && S_ISREG(cst.st_mode)) {
+		if ( options.dedup )
+			dedup_release(f);
 		unlink(cached);
+		if ( cleaner )
+			cleaner_remove(cleaner,cached+strlen(options.cache_dir)+1);
 	}
+	if ( cache_index )
+		index_remove(cache_index,file_get_dest(f));
 }
 
 void file_destroy( vfile_t *f ) {
@@ -271,6 +489,10 @@ void file_destroy( vfile_t *f ) {
 			free(f->cached);
 		if (f->command)
 			free((char*)f->command);
+		if (f->blob)
+			free(f->blob);
+		if ( f->mem )
+			munmap(f->mem,f->mem_size);
 		if ( f->fdh >= 0 )
 			close(f->fdh);
 		free(f);
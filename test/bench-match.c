@@ -0,0 +1,111 @@
+/*
+	Cmdfs2 : bench-match.c
+
+	Microbenchmark of file selection: the compiled rules against the previous
+	one regex per extension/path-re/exclude-re approach. Build and run with
+	"make bench".
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <time.h>
+
+#define EXTENSIONS 60
+#define PATHS 20000
+#define ROUNDS 10
+
+static const char *path_res[] = { ".*/incoming/.*\\.raw", ".*/scans/[0-9]*\\.tiff*", ".*/music/.*/cover" };
+static const char *exclude_res[] = { ".*/\\.git/", ".*/working-files/", ".*/tmp/.*~" };
+#define NELEM(a) (sizeof(a)/sizeof(a[0]))
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main( int argc, char **argv ) {
+	char *exts[EXTENSIONS];
+	for ( int i = 0; i < EXTENSIONS; i++ ) {
+		if ( asprintf(&exts[i],"e%c%c",'a'+i%26,'a'+i/26) < 0 )
+			return 1;
+	}
+	// paths with a mix of matching and non-matching extensions
+	char *paths[PATHS];
+	const char *dirs[] = { "/data/photos/2010", "/data/incoming", "/data/.git/objects", "/data/music/artist/album", "/data/tmp", "/data/scans" };
+	for ( int i = 0; i < PATHS; i++ ) {
+		if ( asprintf(&paths[i],"%s/file%d.%s%s",dirs[i%NELEM(dirs)],i,i%3 ? exts[i%EXTENSIONS] : "xyz",i%7 ? "" : "~") < 0 )
+			return 1;
+	}
+
+	// previous implementation
+	regex_t ext_re[EXTENSIONS+NELEM(path_res)];
+	regex_t excl_re[NELEM(exclude_res)];
+	int path_cnt = 0;
+	for ( int i = 0; i < EXTENSIONS; i++ ) {
+		char *expr;
+		if ( asprintf(&expr,".*/.*\\.%s",exts[i]) < 0 )
+			return 1;
+		regcomp(ext_re+path_cnt++,expr,REG_ICASE|REG_NOSUB);
+		free(expr);
+	}
+	for ( int i = 0; i < NELEM(path_res); i++ )
+		regcomp(ext_re+path_cnt++,path_res[i],0);
+	for ( int i = 0; i < NELEM(exclude_res); i++ )
+		regcomp(excl_re+i,exclude_res[i],0);
+
+	// compiled rules
+	rules_t *rules = rules_create();
+	for ( int i = 0; i < EXTENSIONS; i++ )
+		rules_add_extension(rules,exts[i]);
+	for ( int i = 0; i < NELEM(path_res); i++ )
+		rules_add_path_re(rules,path_res[i]);
+	for ( int i = 0; i < NELEM(exclude_res); i++ )
+		rules_add_exclude_re(rules,exclude_res[i]);
+	rules_compile(rules);
+
+	long old_matches = 0;
+	double start = now();
+	for ( int r = 0; r < ROUNDS; r++ ) {
+		for ( int i = 0; i < PATHS; i++ ) {
+			int excluded = 0, matched = 0;
+			for ( int j = 0; !excluded && j < NELEM(exclude_res); j++ )
+				excluded = !regexec(excl_re+j,paths[i],0,NULL,0);
+			for ( int j = 0; !excluded && !matched && j < path_cnt; j++ )
+				matched = !regexec(ext_re+j,paths[i],0,NULL,0);
+			old_matches += matched;
+		}
+	}
+	double old_time = now() - start;
+
+	long new_matches = 0;
+	start = now();
+	for ( int r = 0; r < ROUNDS; r++ ) {
+		for ( int i = 0; i < PATHS; i++ ) {
+			new_matches += !rules_excluded(rules,paths[i]) && rules_match(rules,paths[i]);
+		}
+	}
+	double new_time = now() - start;
+
+	long lookups = (long)PATHS * ROUNDS;
+	printf("%d extensions, %d path-re, %d exclude-re, %ld lookups\n",EXTENSIONS,(int)NELEM(path_res),(int)NELEM(exclude_res),lookups);
+	printf("regex per rule: %10.0f matches/s (%ld matched)\n",lookups/old_time,old_matches);
+	// counts differ by the "name.ext~" files, which an extension regex matched as a substring
+	printf("compiled rules: %10.0f matches/s (%ld matched)\n",lookups/new_time,new_matches);
+	rules_destroy(rules);
+	return 0;
+}
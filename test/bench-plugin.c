@@ -0,0 +1,131 @@
+/*
+	Cmdfs2 : bench-plugin.c
+
+	Throughput of the reference plugins against the equivalent commands, on
+	one large file (transform speed) and on many small ones (per file
+	overhead). Output is discarded in both cases. Build and run with "make
+	bench", after building src.
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#define LARGE_MB 64
+#define SMALL_KB 64
+#define SMALL_FILES 500
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int discard( void *data, const char *buf, size_t size ) {
+	*(size_t *)data += size;
+	return 0;
+}
+
+// write size bytes of text to path, and its gzipped form to path.gz
+static void make_input( const char *path, size_t size ) {
+	char gz[strlen(path)+4];
+	sprintf(gz,"%s.gz",path);
+	FILE *out = fopen(path,"w");
+	gzFile zout = gzopen(gz,"wb");
+	char line[80];
+	for ( size_t written = 0, i = 0; written < size; i++ ) {
+		int n = snprintf(line,sizeof(line),"Line %zu of the benchmark input, %08zx\n",i,i*2654435761u);
+		fwrite(line,1,n,out);
+		gzwrite(zout,line,n);
+		written += n;
+	}
+	fclose(out);
+	gzclose(zout);
+}
+
+static double run_plugin( plugin_t *p, const char *src, int times, size_t *out ) {
+	*out = 0;
+	double start = now();
+	for ( int i = 0; i < times; i++ )
+		plugin_transform(p,src,discard,out);
+	return now() - start;
+}
+
+static double run_command( const char *text, const char *src, int times ) {
+	command_t *c = command_create(text);
+	int out = open("/dev/null",O_WRONLY);
+	double start = now();
+	for ( int i = 0; i < times; i++ ) {
+		int in = open(src,O_RDONLY);
+		int status;
+		waitpid(command_spawn(c,src,in,out),&status,0);
+		close(in);
+	}
+	double rv = now() - start;
+	close(out);
+	command_destroy(c);
+	return rv;
+}
+
+static void compare( const char *plugin, const char *opts, const char *command, const char *large, const char *small ) {
+	char path[strlen(PLUGIN_DIR)+strlen(plugin)+2];
+	sprintf(path,"%s/%s",PLUGIN_DIR,plugin);
+	plugin_t *p = plugin_create(path,opts);
+	if ( !p ) {
+		printf("%s: not loaded, build src first\n",path);
+		return;
+	}
+	size_t out, small_out;
+	double t = run_plugin(p,large,1,&out); // the command's output is the same size
+	printf("%-12s %-14s %8.1f Mb/s",plugin,"(in process)",out/t/1048576);
+	t = run_plugin(p,small,SMALL_FILES,&small_out);
+	printf(" %8.0f files/s\n",SMALL_FILES/t);
+	t = run_command(command,large,1);
+	printf("%-12s %-14s %8.1f Mb/s",command,"(command)",out/t/1048576);
+	t = run_command(command,small,SMALL_FILES);
+	printf(" %8.0f files/s\n",SMALL_FILES/t);
+	plugin_destroy(p);
+}
+
+int main( int argc, char **argv ) {
+	char dir[] = "/tmp/bench-plugin.XXXXXX";
+	if ( !mkdtemp(dir) ) {
+		perror(dir);
+		return 1;
+	}
+	char large[sizeof(dir)+10], small[sizeof(dir)+10], large_gz[sizeof(dir)+13], small_gz[sizeof(dir)+13];
+	sprintf(large,"%s/large",dir);
+	sprintf(small,"%s/small",dir);
+	sprintf(large_gz,"%s.gz",large);
+	sprintf(small_gz,"%s.gz",small);
+	make_input(large,LARGE_MB*1048576);
+	make_input(small,SMALL_KB*1024);
+
+	printf("%dMb file, %d x %dKb files, output discarded\n",LARGE_MB,SMALL_FILES,SMALL_KB);
+	compare("gunzip.so",NULL,"gzip -dc",large_gz,small_gz);
+	compare("bytemap.so","a-z:A-Z","tr a-z A-Z",large,small);
+
+	unlink(large);
+	unlink(small);
+	unlink(large_gz);
+	unlink(small_gz);
+	rmdir(dir);
+	return 0;
+}
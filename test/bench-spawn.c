@@ -0,0 +1,89 @@
+/*
+	Cmdfs2 : bench-spawn.c
+
+	Microbenchmark of starting transform commands: the previous fork() and
+	/bin/sh -c against command_spawn(), with and without the shell. fork()
+	costs grow with the daemon's memory, so a heap of the given size (Mb,
+	default 256) is touched first. Build and run with "make bench".
+
+	Copyright (C) 2010  Mike Swain
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "cmdfs.h"
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define SPAWNS 1000
+#define COMMAND "cat"
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// previous implementation
+static pid_t fork_spawn( const char *command, int in, int out ) {
+	pid_t pid = fork();
+	if ( !pid ) {
+		dup2(in,STDIN_FILENO);
+		dup2(out,STDOUT_FILENO);
+		char *envp[] = { "INPUT_FILE=/dev/null", NULL };
+		execle("/bin/sh","sh","-c",command,NULL,envp);
+		_exit(127);
+	}
+	return pid;
+}
+
+static void report( const char *name, double elapsed ) {
+	printf("%-24s %8.0f spawns/s\n",name,SPAWNS/elapsed);
+}
+
+int main( int argc, char **argv ) {
+	long heap_mb = argc > 1 ? atol(argv[1]) : 256;
+	char *heap = malloc(heap_mb * 1024 * 1024);
+	memset(heap,1,heap_mb * 1024 * 1024); // resident, so fork() has page tables to copy
+	int in = open("/dev/null",O_RDONLY);
+	int out = open("/dev/null",O_WRONLY);
+	int status;
+
+	double start = now();
+	for ( int i = 0; i < SPAWNS; i++ )
+		waitpid(fork_spawn(COMMAND,in,out),&status,0);
+	double fork_time = now() - start;
+
+	command_t *shell = command_create(COMMAND " </dev/stdin"); // redirection forces the shell
+	start = now();
+	for ( int i = 0; i < SPAWNS; i++ )
+		waitpid(command_spawn(shell,"/dev/null",in,out),&status,0);
+	double shell_time = now() - start;
+
+	command_t *direct = command_create(COMMAND);
+	start = now();
+	for ( int i = 0; i < SPAWNS; i++ )
+		waitpid(command_spawn(direct,"/dev/null",in,out),&status,0);
+	double direct_time = now() - start;
+
+	printf("%d x \"%s\", %ldMb heap\n",SPAWNS,COMMAND,heap_mb);
+	report("fork, sh -c",fork_time);
+	report("posix_spawn, sh -c",shell_time);
+	report("posix_spawn, direct",direct_time);
+	command_destroy(shell);
+	command_destroy(direct);
+	free(heap);
+	return 0;
+}
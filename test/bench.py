@@ -0,0 +1,129 @@
+#!/usr/bin/python
+# Read throughput of large cached files, with and without zero-copy reads and
+# with mmap. Reports MB/s and cmdfs CPU seconds per GB read for each, and the
+# system calls cmdfs makes per MB read when strace is installed. Run against
+# an older build to compare read paths. Then times listing a directory of
+# LISTING entries, on its own and followed by a stat of each as ls -l does.
+import os, sys, shutil, subprocess, signal, time
+
+CMDFS = '../src/cmdfs'
+FILES = 8
+FILE_MB = 64
+ROUNDS = 4
+BLOCK = 1024*1024
+LISTING = 100000
+
+def rmf(root):
+    if os.path.isdir(root):
+        shutil.rmtree(root)
+
+def cpu_seconds(pid):
+    fields = open('/proc/%d/stat' % pid).read().rsplit(')',1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / float(os.sysconf('SC_CLK_TCK')) # utime + stime
+
+def which(program):
+    for d in os.environ.get('PATH','').split(os.pathsep):
+        if os.access(os.path.join(d,program),os.X_OK):
+            return os.path.join(d,program)
+    return None
+
+def read_all(path):
+    f = open(path,'rb')
+    n = 0
+    while True:
+        b = f.read(BLOCK)
+        if not b:
+            break
+        n += len(b)
+    f.close()
+    return n
+
+def syscalls_per_mb(pid,dest):
+    if not which('strace'):
+        return None
+    tracer = subprocess.Popen(['strace','-c','-f','-q','-p',str(pid)],stderr=subprocess.PIPE,universal_newlines=True)
+    time.sleep(1) # attached
+    total = 0
+    for i in range(0,FILES):
+        total += read_all('%s/big%d' % (dest,i))
+    tracer.send_signal(signal.SIGINT)
+    for line in tracer.communicate()[1].splitlines():
+        fields = line.split()
+        if fields and fields[-1] == 'total':
+            return int(fields[3]) / (total/float(1024*1024))
+    return None
+
+def bench(root,name,options):
+    source = root+'/source'
+    dest = root+'/dest'
+    cache = root+'/cache-'+name
+    os.makedirs(dest)
+    os.makedirs(cache)
+    fs = subprocess.Popen([os.path.dirname(__file__)+'/'+CMDFS,source,dest,'-f','-ocache-dir=%s,path-re=.*,command=cat,%s' % (cache,options)])
+    try:
+        time.sleep(2)
+        for i in range(0,FILES):
+            read_all('%s/big%d' % (dest,i)) # generate cache
+        cpu = cpu_seconds(fs.pid)
+        start = time.time()
+        total = 0
+        for r in range(0,ROUNDS):
+            for i in range(0,FILES):
+                total += read_all('%s/big%d' % (dest,i))
+        elapsed = time.time() - start
+        cpu = cpu_seconds(fs.pid) - cpu
+        gb = total / float(1024*1024*1024)
+        calls = syscalls_per_mb(fs.pid,dest)
+        print('%-12s %8.1f MB/s %8.2f cpu s/GB %s' % (name,total/elapsed/(1024*1024),cpu/gb,
+            '%8.1f syscalls/MB' % calls if calls is not None else '(no strace, syscalls not counted)'))
+    finally:
+        subprocess.call(['fusermount','-u',dest])
+        fs.wait()
+        os.rmdir(dest)
+
+def bench_listing(root):
+    source = root+'/listing'
+    dest = root+'/dest'
+    cache = root+'/cache-listing'
+    os.makedirs(source)
+    os.makedirs(dest)
+    os.makedirs(cache)
+    for i in range(0,LISTING):
+        open('%s/f%d.txt' % (source,i),'w').close()
+    fs = subprocess.Popen([os.path.dirname(__file__)+'/'+CMDFS,source,dest,'-f','-ocache-dir=%s,path-re=\\.txt$,stat-pass-thru' % cache])
+    try:
+        time.sleep(2)
+        for name,stat in (('listing',False),('listing+stat',True)):
+            start = time.time()
+            names = os.listdir(dest)
+            if stat:
+                for n in names:
+                    os.stat(dest+'/'+n)
+            elapsed = time.time() - start
+            print('%-12s %8d entries %8.2f s %8.0f entries/s' % (name,len(names),elapsed,len(names)/elapsed))
+    finally:
+        subprocess.call(['fusermount','-u',dest])
+        fs.wait()
+        os.rmdir(dest)
+
+def main():
+    root = '%s/bench-run/%d' % (os.path.dirname(os.path.abspath(__file__)),os.getpid())
+    rmf(root)
+    os.makedirs(root+'/source')
+    block = os.urandom(BLOCK)
+    for i in range(0,FILES):
+        f = open('%s/source/big%d' % (root,i),'wb')
+        for b in range(0,FILE_MB):
+            f.write(block)
+        f.close()
+    print('%d x %dMB cached files, read %d times' % (FILES,FILE_MB,ROUNDS))
+    try:
+        bench(root,'copy','nozero-copy')
+        bench(root,'zero-copy','zero-copy')
+        bench(root,'mmap','mmap')
+        bench_listing(root)
+    finally:
+        rmf(root)
+
+if __name__ == '__main__':
+    main()
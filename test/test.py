@@ -6,6 +6,7 @@ import sys
 import os
 import unittest
 import filecmp
+import gzip
 import time
 
 CMDFS = '../src/cmdfs'
@@ -62,6 +63,13 @@ class TestCmdfs(unittest.TestCase):
     def assertFilesEqual(self,file,other,msg):
         self.assertTrue(filecmp.cmp(file, other) )
 
+    # command, noting each time it runs for count_runs()
+    def counted(self,command):
+        return 'echo run >> %s; %s' % (self.runs,command)
+
+    def count_runs(self):
+        return len(open(self.runs).readlines()) if os.path.exists(self.runs) else 0
+
     def setUp(self):
         self.testDir = os.path.dirname(__file__)
         name = "%s/test-run/%d/%s" % (self.testDir,os.getpid(),self.id());
@@ -70,6 +78,7 @@ class TestCmdfs(unittest.TestCase):
         self.source = "%s/%s" % (name,SOURCE)
         self.dest = "%s/%s" % (name,DEST)
         self.cache = "%s/%s" % (name,CACHE)
+        self.runs = "%s/runs" % name
         os.makedirs(self.source)
         os.makedirs(self.dest)
         os.makedirs(self.cache)
@@ -94,11 +103,41 @@ class TestCmdfs(unittest.TestCase):
         setContents(s+'test',shortcontent)
         self.assertFileContentsEqual( d+'test',os.path.abspath(s+'test'),'token replace command')
 
+    def test_directCommand(self):
+        (s,d) = self.mount( self.source, self.dest, { 'path-re' : '.*', 'command': 'cat %f' })
+        setContents(s+'with space',shortcontent)
+        self.assertFileContentsEqual( d+'with space',shortcontent,'command run without shell, file name one argument')
+
     def test_filterCommand(self):
         (s,d) = self.mount( self.source, self.dest, { 'path-re' : '.*', 'command': 'wc -w' })
         setContents(s+'test',"one two three")
         self.assertFileContentsEqual(d+'test','3\n','filter command')
 
+    def test_coprocess(self):
+        script = self.cache+'/../coprocess.sh'
+        starts = self.cache+'/../starts'
+        setContents(script,'echo start >> %s\nwhile read -r f; do wc -c < "$f" ; cat "$f"; echo 0; done\n' % starts)
+        (s,d) = self.mount( self.source, self.dest, { 'coprocess-count' : '1', 'path-re' : '.*', 'coprocess': 'sh %s' % script })
+        setContents(s+'one',shortcontent)
+        setContents(s+'two',"two")
+        self.assertFileContentsEqual(d+'one',shortcontent,'co-process output')
+        self.assertFileContentsEqual(d+'two',"two",'second file from co-process')
+        self.assertEqual(len(open(starts).readlines()),1,'co-process started once')
+
+    def test_plugins(self):
+        plugins = os.path.abspath(self.testDir+'/../src')
+        (s,d) = self.mount( self.source, self.dest, { 'path-re' : '.*', 'plugin' : plugins+'/gunzip.so' })
+        compressed = gzip.open(s+'test','wb')
+        compressed.write(shortcontent)
+        compressed.close()
+        self.assertFileContentsEqual(d+'test',shortcontent,'transformed by plugin')
+        self.unmount(self.dest)
+        mapped = self.cache+'/mapped'
+        (s,d) = self.mount( self.source, self.dest, { 'cache-dir' : mapped, 'path-re' : '.*', 'plugin' : plugins+'/bytemap.so', 'plugin-opts' : 'a-z:A-Z' })
+        setContents(s+'test',"mapped")
+        self.assertFileContentsEqual(d+'test',"MAPPED",'mapped by plugin as read')
+        self.assertEqual(os.listdir(mapped),[],'mapped output not cached')
+
     def test_bigFile(self):
         (s,d) = self.mount( self.source, self.dest, { 'path-re' : '.*', 'command': 'dd' })
         for t in range(0,100):
@@ -113,6 +152,131 @@ class TestCmdfs(unittest.TestCase):
             except AssertionError:
                 raise;
 
+    def test_nozero_copy(self):
+        (s,d) = self.mount( self.source, self.dest, { 'nozero-copy' : None, 'path-re' : '.*', 'command': 'cat' })
+        shutil.copyfile(self.testDir+'/test.jpg', s+'test.jpg')
+        self.assertFilesEqual(d+'test.jpg',s+'test.jpg','read through buffer')
+
+    def test_mmap(self):
+        (s,d) = self.mount( self.source, self.dest, { 'mmap' : None, 'path-re' : '.*', 'command': 'cat' })
+        shutil.copyfile(self.testDir+'/test.jpg', s+'test.jpg')
+        self.assertFilesEqual(d+'test.jpg',s+'test.jpg','read from mapping')
+
+    def test_transform_workers(self):
+        (s,d) = self.mount( self.source, self.dest, { 'transform-workers' : '2', 'path-re' : '.*', 'command': 'sleep 1; cat' })
+        for t in range(0,4):
+            setContents(s+'test%d' % t,shortcontent)
+        start = time.time()
+        readers = [subprocess.Popen(["cat",d+'test%d' % t],stdout=subprocess.PIPE) for t in range(0,4)]
+        for r in readers:
+            self.assertEqual(r.communicate()[0],shortcontent,'file content')
+        elapsed = time.time()-start
+        self.assertTrue( elapsed >= 2, 'no more than 2 commands at once' )
+        self.assertTrue( elapsed < 4, 'commands run in parallel' )
+
+    def test_single_flight(self):
+        (s,d) = self.mount( self.source, self.dest, { 'path-re' : '.*', 'command': self.counted('sleep 1; cat') })
+        setContents(s+'test',shortcontent)
+        readers = [subprocess.Popen(["cat",d+'test'],stdout=subprocess.PIPE) for t in range(0,8)]
+        for r in readers:
+            self.assertEqual(r.communicate()[0],shortcontent,'file content')
+        self.assertEqual(self.count_runs(),1,'command run once for concurrent readers')
+        for (path,dirs,filenames) in os.walk(self.cache):
+            self.assertEqual([f for f in filenames if f.endswith('.new')],[],'no temporary files left')
+
+    def test_largeDir(self):
+        (s,d) = self.mount( self.source, self.dest, { 'path-re' : '\\.txt$' })
+        names = ['file%d.txt' % t for t in range(0,5000)]
+        for n in names:
+            setContents(s+n,shortcontent)
+        setContents(s+'hidden.bin',shortcontent)
+        self.assertEqual(sorted(os.listdir(d)),sorted(names),'listing spanning many reads')
+
+    def test_listing_cache(self):
+        (s,d) = self.mount( self.source, self.dest, { 'listing-cache' : '1', 'path-re' : '.*' })
+        setContents(s+'one',shortcontent)
+        time.sleep(1.1) # listings of directories changed in the last second aren't kept
+        self.assertEqual(os.listdir(d),['one'],'first listing')
+        self.assertEqual(os.listdir(d),['one'],'cached listing')
+        setContents(s+'two',shortcontent)
+        self.assertEqual(sorted(os.listdir(d)),['one','two'],'listing after change')
+
+    def test_kernel_cache_monitored(self):
+        (s,d) = self.mount( self.source, self.dest, { 'monitor' : None, 'path-re' : '.*' })
+        setContents(s+'test',shortcontent)
+        self.assertEqual(os.stat(d+'test').st_size,len(shortcontent),'output size')
+        time.sleep(1.1) # source must be newer
+        setContents(s+'test',shortcontent*2)
+        time.sleep(1)
+        self.assertEqual(os.stat(d+'test').st_size,len(shortcontent*2),'kernel told of the change')
+        self.assertFileContentsEqual(d+'test',shortcontent*2,'file content')
+        os.remove(s+'test')
+        time.sleep(1)
+        self.assertFalse(os.path.exists(d+'test'),'kernel told of the removal')
+
+    def test_readdir_attrs(self):
+        (s,d) = self.mount( self.source, self.dest, { 'readdir-attrs' : '5', 'path-re' : '.*', 'command': 'cat; echo more' })
+        setContents(s+'cached',shortcontent)
+        setContents(s+'uncached',shortcontent)
+        self.assertFileContentsEqual(d+'cached',shortcontent+'more\n','file content')
+        self.assertEqual(sorted(os.listdir(d)),['cached','uncached'],'listing')
+        self.assertEqual(os.stat(d+'cached').st_size,len(shortcontent+'more\n'),'output size from listing')
+        self.assertEqual(os.stat(d+'uncached').st_size,len(shortcontent+'more\n'),'uncached output size')
+
+    def test_stream(self):
+        (s,d) = self.mount( self.source, self.dest, { 'stream' : None, 'path-re' : '.*', 'command': 'cat; sleep 3; echo done' })
+        setContents(s+'test',shortcontent)
+        start = time.time()
+        f = open(d+'test')
+        self.assertEqual(f.read(len(shortcontent)),shortcontent,'output so far')
+        self.assertTrue( time.time()-start < 3, 'read before command finished' )
+        self.assertEqual(f.read(),'done\n','rest of output')
+        f.close()
+        self.assertEqual(os.stat(d+'test').st_size, len(shortcontent+'done\n'),'size once finished')
+
+    def test_stream_past_size(self):
+        (s,d) = self.mount( self.source, self.dest, { 'stream' : None, 'path-re' : '.*', 'command': 'cat; sleep 2; cat' })
+        setContents(s+'test',shortcontent)
+        f = open(d+'test')
+        time.sleep(0.5) # first cat done
+        self.assertEqual(os.stat(d+'test').st_size,len(shortcontent),'provisional size, output so far')
+        self.assertEqual(f.read(),shortcontent*2,'read past the provisional size')
+        f.close()
+
+    def test_dedup(self):
+        (s,d) = self.mount( self.source, self.dest, { 'dedup' : None, 'path-re' : '.*', 'command': self.counted('cat') })
+        os.mkdir(s+'copy')
+        setContents(s+'test',shortcontent)
+        setContents(s+'copy/test',shortcontent)
+        self.assertFileContentsEqual(d+'test',shortcontent,'file content')
+        self.assertFileContentsEqual(d+'copy/test',shortcontent,'duplicate content')
+        self.assertEqual(self.count_runs(),1,'duplicate transformed once')
+
+    def test_serve_stale(self):
+        (s,d) = self.mount( self.source, self.dest, { 'serve-stale' : None, 'entry_timeout' : '0', 'attr_timeout' : '0', 'path-re' : '.*', 'command': 'sleep 2; cat' })
+        setContents(s+'test',"old")
+        self.assertFileContentsEqual(d+'test',"old",'first output')
+        time.sleep(1.1) # source must be newer
+        setContents(s+'test',"new")
+        start = time.time()
+        self.assertFileContentsEqual(d+'test',"old",'stale output served')
+        self.assertTrue(time.time()-start < 1,'stale output served without waiting')
+        time.sleep(3)
+        self.assertFileContentsEqual(d+'test',"new",'regenerated in the background')
+
+    def test_index_remount(self):
+        options = { 'path-re' : '.*', 'command': 'wc -c' }
+        (s,d) = self.mount( self.source, self.dest, dict(options))
+        setContents(s+'test',shortcontent)
+        self.assertEqual(os.stat(d+'test').st_size, len('9\n'),'output size')
+        self.unmount(self.dest)
+        (s,d) = self.mount( self.source, self.dest, dict(options))
+        self.assertEqual(os.stat(d+'test').st_size, len('9\n'),'output size from index after remount')
+        time.sleep(1)
+        setContents(s+'test',shortcontent*2)
+        self.assertEqual(os.stat(d+'test').st_size, len('18\n'),'index entry replaced when source changes')
+        self.assertFileContentsEqual(d+'test','18\n','file content')
+
     def test_subdirs(self):
         (s,d) = self.mount( self.source, self.dest, { 'path-re' : '.*' })
         p = 'sub1/sub2';
@@ -120,6 +284,15 @@ class TestCmdfs(unittest.TestCase):
         setContents(s+p+'/test',shortcontent)
         self.assertFileContentsEqual( d+p+'/test',shortcontent,'file content in subdir')
 
+    def test_long_path(self):
+        (s,d) = self.mount( self.source, self.dest, { 'path-re' : '.*', 'command': self.counted('cat') })
+        p = '/'.join(['%s%d' % ('d'*60,t) for t in range(0,5)]) # longer than NAME_MAX as one name
+        os.makedirs(s+p)
+        setContents(s+p+'/test',shortcontent)
+        self.assertFileContentsEqual( d+p+'/test',shortcontent,'file content in deep subdir')
+        self.assertFileContentsEqual( d+p+'/test',shortcontent,'file content again')
+        self.assertEqual(self.count_runs(),1,'deep path cached')
+
     def test_delete(self):
         (s,d) = self.mount( self.source, self.dest, { 'entry_timeout' : '0', 'path-re' : '.*' })
         setContents(s+'test',shortcontent)
@@ -159,6 +332,17 @@ class TestCmdfs(unittest.TestCase):
         self.assertTrue(os.path.isfile(d+'test.two'))
         self.assertFalse(os.path.isfile(d+'test.three'))
 
+    def test_extension_suffix(self):
+        (s,d) = self.mount( self.source, self.dest, { 'extension' : 'jpg;tar.gz' })
+        setContents(s+'upper.JPG',shortcontent)
+        setContents(s+'archive.tar.gz',shortcontent)
+        setContents(s+'other.gz',shortcontent)
+        setContents(s+'backup.jpg~',shortcontent)
+        self.assertTrue(os.path.isfile(d+'upper.JPG'))
+        self.assertTrue(os.path.isfile(d+'archive.tar.gz'))
+        self.assertFalse(os.path.isfile(d+'other.gz'))
+        self.assertFalse(os.path.isfile(d+'backup.jpg~'))
+
     def test_mime_re(self):
         (s,d) = self.mount( self.source, self.dest, { 'mime-re' : 'image/.*' })
         shutil.copyfile(self.testDir+'/test.jpg', s+"testjpgnoext")
@@ -190,6 +374,20 @@ class TestCmdfs(unittest.TestCase):
         self.assertTrue( mean > expiry/2, 'mean age > half expiry age'  )
         self.assertTrue( mean < expiry*2,  'mean age < twice expiry age' )
 
+    def test_cache_entries_lru(self):
+        (s,d) = self.mount( self.source, self.dest, { 'cache-entries' : '2', 'path-re' : '.*', 'command': self.counted('cat') })
+        for name in ['a','b','c']:
+            setContents(s+name,name)
+        self.assertFileContentsEqual(d+'a','a','first file')
+        self.assertFileContentsEqual(d+'b','b','second file')
+        self.assertFileContentsEqual(d+'a','a','first file used again')
+        self.assertFileContentsEqual(d+'c','c','third file')
+        time.sleep(1)
+        self.assertFileContentsEqual(d+'a','a','recently used file kept')
+        self.assertEqual(self.count_runs(),3,'recently used file not transformed again')
+        self.assertFileContentsEqual(d+'b','b','least recently used file culled')
+        self.assertEqual(self.count_runs(),4,'culled file transformed again')
+
     def test_hide_empty_dirs(self):
         (s,d) = self.mount( self.source, self.dest, { 'hide-empty-dirs' : None, 'path-re' : '.*/visiblefile' })
         os.makedirs(s+'level1')
@@ -213,6 +411,95 @@ class TestCmdfs(unittest.TestCase):
                 self.assertTrue('visiblefile' in filenames,"matching file")
                 self.assertFalse('notvisible' in filenames,"no invisible file")
 
+    def test_hide_empty_dirs_monitored(self):
+        (s,d) = self.mount( self.source, self.dest, { 'hide-empty-dirs' : None, 'monitor' : None, 'entry_timeout' : '0', 'path-re' : '.*/visiblefile' })
+        os.makedirs(s+'level1/level2')
+        setContents(s+'level1/level2/notvisible',shortcontent)
+        self.assertFalse(os.path.isdir(d+'level1'),'invisible dir - no visible files in any descendant')
+        setContents(s+'level1/level2/visiblefile',shortcontent)
+        time.sleep(1)
+        self.assertTrue(os.path.isdir(d+'level1'),'visible dir - monitor reported new visible file')
+        self.assertTrue(os.path.isfile(d+'level1/level2/visiblefile'),'match')
+        os.remove(s+'level1/level2/visiblefile')
+        time.sleep(1)
+        self.assertFalse(os.path.isdir(d+'level1'),'invisible dir - monitor reported visible file removed')
+
+    def test_monitor_backends(self):
+        os.makedirs(self.source+'/sub')
+        for backend in ['fanotify','nofanotify']:
+            (s,d) = self.mount( self.source, self.dest, { 'monitor' : None, backend : None, 'path-re' : '.*', 'command': self.counted('cat') })
+            setContents(s+'sub/'+backend,shortcontent)
+            time.sleep(3) # settle and transform
+            self.assertEqual(self.count_runs(),1,'%s: new file cached without being read' % backend)
+            os.remove(self.runs)
+            self.unmount(self.dest)
+
+    def test_monitor_settle(self):
+        (s,d) = self.mount( self.source, self.dest, { 'monitor' : None, 'monitor-settle' : '2', 'path-re' : '.*', 'command': self.counted('cat') })
+        f = open(s+'test','w')
+        for c in shortcontent: # for longer than the settle time, never pausing that long
+            f.write(c)
+            f.flush()
+            time.sleep(0.4)
+        f.close()
+        time.sleep(4)
+        self.assertEqual(self.count_runs(),1,'file written in parts transformed once it settled')
+        self.assertFileContentsEqual(d+'test',shortcontent,'file content')
+        self.assertEqual(self.count_runs(),1,'read from cache')
+
+    def test_monitor_prefetch_one_worker(self):
+        (s,d) = self.mount( self.source, self.dest, { 'monitor' : None, 'transform-workers' : '1', 'path-re' : '.*', 'command': 'sleep 2; cat' })
+        setContents(s+'a',shortcontent)
+        setContents(s+'b',shortcontent)
+        time.sleep(1.5) # settled, the only worker prefetching one of them
+        readers = [subprocess.Popen(["cat",d+n],stdout=subprocess.PIPE) for n in ['a','b']]
+        start = time.time()
+        while [r for r in readers if r.poll() is None] and time.time()-start < 15:
+            time.sleep(0.1)
+        self.assertFalse([r for r in readers if r.poll() is None],'opened during their prefetch without deadlock')
+        for r in readers:
+            self.assertEqual(r.communicate()[0],shortcontent,'file content')
+
+    def test_monitor_lazy(self):
+        os.makedirs(self.source+'/used')
+        os.makedirs(self.source+'/unused')
+        (s,d) = self.mount( self.source, self.dest, { 'monitor' : None, 'nofanotify' : None, 'monitor-lazy' : None, 'path-re' : '.*', 'command': self.counted('cat') })
+        os.listdir(d+'used')
+        time.sleep(1)
+        setContents(s+'used/test',shortcontent)
+        setContents(s+'unused/test',shortcontent)
+        time.sleep(3) # settle and transform
+        self.assertEqual(self.count_runs(),1,'only file in accessed directory cached')
+        self.assertFileContentsEqual(d+'unused/test',shortcontent,'unwatched directory still served')
+
+    def test_monitor_overflow(self):
+        # inotify's queue limit is read when the monitor starts, lower it if allowed
+        limit = '/proc/sys/fs/inotify/max_queued_events'
+        saved = open(limit).read()
+        try:
+            setContents(limit,'64')
+            count = 200
+        except IOError:
+            saved = None
+            count = 6000 # a few events each, more than the default 16384 queued
+        try:
+            (s,d) = self.mount( self.source, self.dest, { 'monitor' : None, 'nofanotify' : None, 'path-re' : '.*', 'command': 'cat' })
+        finally:
+            if saved:
+                setContents(limit,saved)
+        os.makedirs(s+'sub')
+        setContents(s+'sub/changed','old')
+        self.assertFileContentsEqual(d+'sub/changed','old','cached before events were lost')
+        time.sleep(1.1) # source must be newer
+        names = ['burst%d' % t for t in range(0,count)]
+        for n in names:
+            setContents(s+'sub/'+n,shortcontent)
+        setContents(s+'sub/changed','new') # its events lost in the overflow
+        time.sleep(5) # resynchronise and settle
+        self.assertEqual(sorted(os.listdir(d+'sub')),sorted(names+['changed']),'listing matches the source')
+        self.assertFileContentsEqual(d+'sub/changed','new','cache matches the source')
+        self.assertFileContentsEqual(d+'sub/'+names[-1],shortcontent,'file added in the burst')
+
     def test_stat_pass_thru(self):
         (s,d) = self.mount( self.source, self.dest, { 'stat-pass-thru' : None, 'path-re' : '.*', 'command': 'echo -n "abc"' })
         setContents(s+'test',shortcontent)